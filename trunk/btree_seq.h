@@ -14,12 +14,36 @@
 
 #include <assert.h>
 #include <iterator>
+#include <memory>
+#include <new>
+
+#ifdef __AVX2__
+#define __BTREE_SEQ_SIMD
+#include <immintrin.h>
+#endif
 
 #if __cplusplus >= 201103L
 
 #include <initializer_list>
 #include <utility>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <thread>
+#include <vector>
+#include <exception>
+
+#endif
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define __BTREE_SEQ_PMR
+#endif
 #endif
 
 /** @file btree_seq.h
@@ -43,9 +67,843 @@ namespace ___alexkupri_helpers
 	template<> struct my_is_integer<unsigned int>  {  typedef my_true_type __type;  };
 	template<> struct my_is_integer<long>  {  typedef my_true_type __type;  };
 	template<> struct my_is_integer<unsigned long>  {  typedef my_true_type __type;  };
+
+	// Finding the index of the first of n ascending prefix counters, which is greater than pos,
+	// i.e. the child containing pos. Unlike subtracting child sizes one by one, the compares
+	// do not depend on each other. The last counter must be greater than pos.
+	template<int Size> struct my_prefix_search
+	{
+		template<typename C>
+		static size_t find(const C *nums,size_t,C pos)
+		{
+			size_t k=0;
+			while(nums[k]<=pos){
+				k++;
+			}
+			return k;
+		}
+	};
+#ifdef __BTREE_SEQ_SIMD
+	// Number of lanes not greater than pos by the mask of greater lanes.
+	static const unsigned char my_lanes_not_greater[16]=
+		{4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0};
+	// 64-bit counters: counters never reach 2^63, so signed compare is safe.
+	// Blocks are compared without branches, we only leave at the first block containing pos.
+	template<> struct my_prefix_search<8>
+	{
+		template<typename C>
+		static size_t find(const C *nums,size_t n,C pos)
+		{
+			const long long *p=reinterpret_cast<const long long*>(nums);
+			size_t j=0;
+			int mask;
+			__m256i vpos=_mm256_set1_epi64x(static_cast<long long>(pos));
+			for(;j+4<=n;j+=4){
+				__m256i v=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p+j));
+				mask=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v,vpos)));
+				if(mask){
+					return j+my_lanes_not_greater[mask];
+				}
+			}
+			while(nums[j]<=pos){
+				j++;
+			}
+			return j;
+		}
+	};
+	// 32-bit counters may exceed 2^31, so both sides are biased by 2^31
+	// to make the signed compare unsigned. Eight lanes per block.
+	template<> struct my_prefix_search<4>
+	{
+		template<typename C>
+		static size_t find(const C *nums,size_t n,C pos)
+		{
+			const int *p=reinterpret_cast<const int*>(nums);
+			size_t j=0;
+			int mask;
+			__m256i bias=_mm256_set1_epi32(static_cast<int>(0x80000000u));
+			__m256i vpos=_mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(pos)),bias);
+			for(;j+8<=n;j+=8){
+				__m256i v=_mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p+j)),bias);
+				mask=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v,vpos)));
+				if(mask){
+					return (mask&15)?j+my_lanes_not_greater[mask&15]:j+4+my_lanes_not_greater[mask>>4];
+				}
+			}
+			while(nums[j]<=pos){
+				j++;
+			}
+			return j;
+		}
+	};
+#endif
+
+	// Hint to load the cache line with p, if the compiler supports it.
+	inline void my_prefetch(const void *p)
+	{
+#ifdef __GNUC__
+		__builtin_prefetch(p);
+#else
+		(void)p;
+#endif
+	}
+	// Hint to load the cache lines with [p,p+bytes).
+	inline void my_prefetch_range(const void *p,size_t bytes)
+	{
+		const char *c=static_cast<const char*>(p);
+		for(size_t j=0;j<bytes;j+=64){
+			my_prefetch(c+j);
+		}
+	}
+
+	// Selecting one of two types by a compile-time condition.
+	template<bool Cond,typename T1,typename T2> struct my_select{typedef T1 type;};
+	template<typename T1,typename T2> struct my_select<false,T1,T2>{typedef T2 type;};
+	// Compile-time flag for choosing an overload.
+	template<bool B> struct my_bool{};
+	// Whether destroying a T through the allocator A does nothing, so that it can be skipped.
+	template<typename T,typename A> struct my_trivial_destroy{enum{value=0};};
+#if __cplusplus >= 201103L
+	template<typename T> struct my_trivial_destroy<T,std::allocator<T> >
+		{enum{value=std::is_trivially_destructible<T>::value};};
+#endif
+	// Whether the nodes allocated by a need not be freed one by one, because
+	// the memory is given back all at once (a monotonic arena).
+	template<typename A> struct my_arena
+	{
+		static bool check(const A &){return false;}
+	};
+#ifdef __BTREE_SEQ_PMR
+	template<typename T> struct my_trivial_destroy<T,std::pmr::polymorphic_allocator<T> >
+		{enum{value=std::is_trivially_destructible<T>::value};};
+	template<typename T> struct my_arena<std::pmr::polymorphic_allocator<T> >
+	{
+		static bool check(const std::pmr::polymorphic_allocator<T> &a)
+			{return dynamic_cast<std::pmr::monotonic_buffer_resource*>(a.resource())!=0;}
+	};
+#endif
+	// Member types of the allocator A, its rebinding and constructing the elements.
+	// Since C++11 they are taken from std::allocator_traits, so that the allocators
+	// having only the minimal interface (allocate, deallocate and value_type) can be used.
+	template<typename A> struct my_alloc_traits
+	{
+#if __cplusplus >= 201103L
+		typedef std::allocator_traits<A> traits;
+		typedef typename traits::value_type value_type;
+		typedef value_type &reference;
+		typedef const value_type &const_reference;
+		typedef typename traits::pointer pointer;
+		typedef typename traits::const_pointer const_pointer;
+		typedef typename traits::size_type size_type;
+		typedef typename traits::difference_type difference_type;
+		template<typename N> struct rebind{typedef typename traits::template rebind_alloc<N> other;};
+		enum{
+			propagate_on_move=traits::propagate_on_container_move_assignment::value,
+			propagate_on_swap=traits::propagate_on_container_swap::value
+		};
+		template<typename... Args> static void construct(A &a,value_type *p,Args&&... args)
+			{traits::construct(a,p,std::forward<Args>(args)...);}
+		static void destroy(A &a,value_type *p){traits::destroy(a,p);}
+		static A select_on_copy(const A &a){return traits::select_on_container_copy_construction(a);}
+#else
+		typedef typename A::value_type value_type;
+		typedef typename A::reference reference;
+		typedef typename A::const_reference const_reference;
+		typedef typename A::pointer pointer;
+		typedef typename A::const_pointer const_pointer;
+		typedef typename A::size_type size_type;
+		typedef typename A::difference_type difference_type;
+		template<typename N> struct rebind{typedef typename A::template rebind<N>::other other;};
+		enum{propagate_on_move=0,propagate_on_swap=0};
+		static void construct(A &a,value_type *p,const value_type &v){a.construct(p,v);}
+		static void destroy(A &a,value_type *p){a.destroy(p);}
+		static A select_on_copy(const A &a){return a;}
+#endif
+	};
+	// Replaces the finger of btree_seq, if P::finger is not set.
+	struct my_no_finger{};
+	// Reference counter of a node, which can be shared by several trees (P::copy_on_write).
+	template<typename S,int Shared> struct my_node_refs
+	{
+		S refs;
+		void init_refs(){refs=1;}
+		S use_count()const{return refs;}
+		void add_ref(){++refs;}
+		S release(){return --refs;}
+	};
+	// Without copy-on-write, every node belongs to one tree.
+	template<typename S> struct my_node_refs<S,0>
+	{
+		void init_refs(){}
+		S use_count()const{return 1;}
+		void add_ref(){}
+		S release(){return 0;}
+	};
+#if __cplusplus >= 201103L
+	// Atomic counter: the nodes are shared with snapshots, which are released by other threads.
+	template<typename S> struct my_node_refs<S,2>
+	{
+		std::atomic<S> refs;
+		void init_refs(){refs.store(1,std::memory_order_relaxed);}
+		S use_count()const{return refs.load(std::memory_order_acquire);}
+		void add_ref(){refs.fetch_add(1,std::memory_order_relaxed);}
+		S release(){return refs.fetch_sub(1,std::memory_order_acq_rel)-1;}
+	};
+#endif
+	// Replaces the published version of btree_seq, if P::copy_on_write is not 2.
+	struct my_no_publication{};
+
+	// Layouts of Branch and Leaf. Base is the Node, which holds the parent pointer
+	// and the index in the parent (and the reference counter with P::copy_on_write).
+	// Hot==false: original layout, counters after the pointers.
+	template<typename Base,typename S,typename C,int L,bool Hot> struct my_branch_layout:public Base
+	{
+		Base* children[L];
+		C nums[L];
+		S fillament;
+	};
+	// Hot==true: fillament and nums right after the parent pointer, i.e. in the first
+	// lines of the node, children (read once per level) after them.
+	template<typename Base,typename S,typename C,int L> struct my_branch_layout<Base,S,C,L,true>:public Base
+	{
+		S fillament;
+		C nums[L];
+		Base* children[L];
+	};
+	template<typename Base,typename V,typename S,int M,bool Hot> struct my_leaf_layout:public Base
+	{
+		V elements[M];
+		S fillament;
+	};
+	// Hot==true: fillament in the first line, elements start at the first multiple of 32
+	// behind it (from the 64-byte aligned node), so each 32-byte vector load lies within
+	// one cache line. This is offset 32, or 64 with copy_on_write, whose reference count
+	// makes the header 32 bytes on 64-bit targets.
+	template<typename Base,typename V,typename S,int M> struct my_leaf_layout<Base,V,S,M,true>:public Base
+	{
+		S fillament;
+		char padding[32-(sizeof(Base)+sizeof(S))%32];
+		V elements[M];
+	};
+
+	// Allocator of nodes aligned to Align bytes. Standard allocators align only to
+	// alignof(max_align_t), so Align extra bytes are taken from the rebound char
+	// allocator, and the shift is kept in the byte before the node.
+	template<typename N,typename A,int Align> struct my_aligned_node_allocator
+	{
+		typedef typename my_alloc_traits<A>::template rebind<char>::other char_alloc_type;
+		char_alloc_type raw;
+		template<typename Other> my_aligned_node_allocator(const Other &a):raw(a){}
+		N *allocate(size_t)
+		{
+			char *p=raw.allocate(sizeof(N)+Align);
+			size_t shift=Align-reinterpret_cast<size_t>(p)%Align;
+			p+=shift;
+			p[-1]=static_cast<char>(shift);
+			return reinterpret_cast<N*>(p);
+		}
+		void deallocate(N *n,size_t)
+		{
+			char *p=reinterpret_cast<char*>(n);
+			raw.deallocate(p-static_cast<unsigned char>(p[-1]),sizeof(N)+Align);
+		}
+	};
+	// Node allocator keeping spare nodes in an intrusive free list (see btree_seq::reserve).
+	// Up to keep nodes are kept when freed. A copy of the pool gets no spare nodes.
+	template<typename N,typename Base> class my_node_pool:public Base
+	{
+		N *spare;
+		size_t spares,keep;
+		void push(N *n)
+		{
+			*reinterpret_cast<N**>(n)=spare;
+			spare=n;
+			spares++;
+		}
+		static N *&next(N *n){return *reinterpret_cast<N**>(n);}
+		//Merge sort of the list of num nodes.
+		static N *sort(N *list,size_t num)
+		{
+			if(num<2){
+				return list;
+			}
+			N *mid=list,*res=0,**tail=&res;
+			for(size_t j=1;j<num/2;j++){
+				mid=next(mid);
+			}
+			N *right=next(mid);
+			next(mid)=0;
+			list=sort(list,num/2);
+			right=sort(right,num-num/2);
+			while(list!=0&&right!=0){
+				N *&first=(right<list)?right:list;
+				*tail=first;
+				tail=&next(first);
+				first=next(first);
+			}
+			*tail=(list!=0)?list:right;
+			return res;
+		}
+		my_node_pool &operator=(const my_node_pool &);
+	public:
+		my_node_pool():spare(0),spares(0),keep(0){}
+		template<typename Other> my_node_pool(const Other &a):Base(a),spare(0),spares(0),keep(0){}
+		my_node_pool(const my_node_pool &that)
+			:Base(static_cast<const Base&>(that)),spare(0),spares(0),keep(0){}
+		~my_node_pool(){release();}
+		N *allocate(size_t num)
+		{
+			if(spare!=0){
+				N *res=spare;
+				spare=*reinterpret_cast<N**>(res);
+				spares--;
+				return res;
+			}
+			return Base::allocate(num);
+		}
+		void deallocate(N *n,size_t num)
+		{
+			if(spares<keep){
+				push(n);
+			}else{
+				Base::deallocate(n,num);
+			}
+		}
+		// Allocating spare nodes up to num, they are kept from now on.
+		void reserve(size_t num)
+		{
+			keep=num;
+			while(spares<num){
+				push(Base::allocate(1));
+			}
+		}
+		// Sorting the spare nodes by address, so that they are taken in the memory order;
+		// the freed nodes are not kept any more.
+		void order()
+		{
+			keep=0;
+			spare=sort(spare,spares);
+		}
+		// Keeping up to num freed nodes from now on, without allocating any.
+		void keep_freed(size_t num){keep=num;}
+		// Exchanging the spare nodes only, the allocators must be equal.
+		void swap_spares(my_node_pool &that)
+		{
+			std::swap(spare,that.spare);
+			std::swap(spares,that.spares);
+			std::swap(keep,that.keep);
+		}
+		// Exchanging the allocators together with their spare nodes.
+		void swap(my_node_pool &that)
+		{
+			std::swap(static_cast<Base&>(*this),static_cast<Base&>(that));
+			swap_spares(that);
+		}
+		// Freeing all the spare nodes, the freed nodes are not kept any more.
+		void release()
+		{
+			keep=0;
+			while(spare!=0){
+				N *n=spare;
+				spare=*reinterpret_cast<N**>(n);
+				Base::deallocate(n,1);
+			}
+			spares=0;
+		}
+	};
+	template<typename N,typename A,int Align> struct my_node_allocator
+	{
+		typedef my_aligned_node_allocator<N,A,Align> type;
+	};
+	template<typename N,typename A> struct my_node_allocator<N,A,0>
+	{
+		typedef typename my_alloc_traits<A>::template rebind<N>::other type;
+	};
 }
 ///  @endcond
 
+/// Default policy of btree_seq, it describes layout of the tree nodes.
+/** To change the policy, derive your own class from this one and
+ * redefine some of constants. */
+struct btree_seq_default_policy
+{
+	/// Branches keep prefix sums of children sizes instead of sizes themselves.
+	/** Prefix sums are searched faster (compares do not depend on each other,
+	 * and AVX2 is used if enabled by compiler), so random access is faster.
+	 * But inserting or erasing an element changes up to L counters per level
+	 * instead of one. */
+	enum {prefix_counts=0};
+	/// Alignment of nodes in bytes (0 - as the allocator returns, or up to 128).
+	/** If nonzero, the nodes are also laid out hot fields first: the counters of
+	 * a branch and the fillament of a leaf share the first cache line with the
+	 * parent pointer, and leaf elements start 32 bytes into the node (64 bytes with
+	 * copy_on_write). Every node costs Align bytes more memory from the allocator. */
+	enum {node_alignment=0};
+	/// Type of subtree counters in branches.
+	/** A narrower type makes branches smaller, but limits the size of the
+	 * container, see btree_seq::max_size(). */
+	typedef size_t counter_type;
+	/// Software prefetch while descending the tree and in sequential scans.
+	/** When a child is chosen, its counters are requested from memory while
+	 * the counters of the parent are being updated; iterators and visit
+	 * request the next leaf while the current one is being processed.
+	 * Off by default: it helps random access to large trees, but it made
+	 * iteration over small and medium containers slower. */
+	enum {prefetch=0};
+	/// operator[] remembers the path to the last accessed leaf (finger search).
+	/** An access near the previous one climbs the remembered path only as far as
+	 * necessary, instead of descending from the root: O(log(distance)) instead of
+	 * O(log(N)). Makes the container bigger and const operator[] unsafe for
+	 * concurrent readers; they should use btree_seq::hint instead. */
+	enum {finger=0};
+	/// Copies of the container share the nodes (copy-on-write).
+	/** Every node keeps the number of containers (or parent nodes) referring to it.
+	 * Copying a container takes constant time: the copy refers to the same root.
+	 * A modification copies the shared nodes on its way (the path from the root
+	 * to the changed elements, and the siblings, which are merged or balanced with
+	 * them), so the first modification after copying takes O(M+L*log(N)) more time.
+	 * Nodes are one word bigger. Copying invalidates the iterators of the source
+	 * as inserting does. With value 1 the counters are not atomic: containers,
+	 * which share nodes, must be used by one thread at a time. Value 2 (C++11)
+	 * makes the counters atomic and enables btree_seq::snapshot() for readers
+	 * in other threads. */
+	enum {copy_on_write=0};
+};
+
+/// Policy for sequences, which are read more often than modified.
+struct btree_seq_prefix_policy:public btree_seq_default_policy
+{
+	/// Prefix sums in branches.
+	enum {prefix_counts=1};
+};
+
+/// Policy with finger search in operator[], for accesses with high locality.
+struct btree_seq_finger_policy:public btree_seq_default_policy
+{
+	/// operator[] remembers the path.
+	enum {finger=1};
+};
+
+/// Policy with software prefetch, for random access to large containers.
+struct btree_seq_prefetch_policy:public btree_seq_default_policy
+{
+	/// Prefetch while descending and scanning.
+	enum {prefetch=1};
+};
+
+/// Policy with cache-line aligned nodes and hot fields first.
+struct btree_seq_aligned_policy:public btree_seq_default_policy
+{
+	/// Nodes start at cache line boundaries.
+	enum {node_alignment=64};
+};
+
+/// Policy with copy-on-write nodes, for containers, which are copied often and changed a little.
+struct btree_seq_cow_policy:public btree_seq_default_policy
+{
+	/// Shared nodes.
+	enum {copy_on_write=1};
+};
+
+/// Policy with atomic copy-on-write nodes and snapshots for concurrent readers (C++11).
+struct btree_seq_mvcc_policy:public btree_seq_default_policy
+{
+	/// Shared nodes with atomic counters.
+	enum {copy_on_write=2};
+};
+
+/// Policy with 32-bit subtree counters, for containers of less than 2^32 elements.
+struct btree_seq_narrow_policy:public btree_seq_default_policy
+{
+	/// 32-bit counters.
+	typedef unsigned int counter_type;
+};
+
+/// Node sizes of btree_seq, computed from the byte budgets for Branch and Leaf.
+/** The defaults of L and M are taken from btree_seq_nodes<T>, so the nodes have
+ * roughly the same size in bytes whatever sizeof(T) is: 512 bytes (8 cache lines)
+ * per branch and 1024 bytes per leaf. Leaves of several pages make random access
+ * faster, but each insertion/erasure moves half a leaf, so it is not the default.
+ * To choose other budgets for one container, pass them explicitly:
+ * <code> btree_seq<T,btree_seq_nodes<T,256,4096>::L,btree_seq_nodes<T,256,4096>::M> </code>,
+ * or specialize btree_seq_nodes<T> for your type.
+ * Neither value is less than 4.
+ * Change from earlier versions: L and M used to default to 30 and 60 for every T.
+ * Now btree_seq<int> has L=31 and M=252 on 64-bit targets, so the node sizes and
+ * the layout of btree_seq<T> with default L and M are not the same as before, and
+ * btree_seq<T> needs a complete T where the defaults are computed. Write
+ * btree_seq<T,30,60> to keep the old nodes, or to name btree_seq of an incomplete T.
+ * The branch budget is 8 cache lines rather than 4. With 256 bytes L is 14 for
+ * 64-bit counters; random inserts, random reads and scans of 10^5 to 5*10^6 ints
+ * showed no difference beyond the run-to-run noise (about 20%) between the two
+ * budgets, and the wider branches keep large trees one level lower.
+ * @tparam T the type of the element
+ * @tparam BranchBytes desired sizeof(Branch).
+ * @tparam LeafBytes desired sizeof(Leaf).
+ * @tparam C type of counters in branches, see btree_seq_default_policy::counter_type.
+ */
+template <typename T,int BranchBytes=512,int LeafBytes=1024,typename C=size_t>
+struct btree_seq_nodes
+{
+	enum {
+		/// Children per branch: a pointer and a counter each, besides the parent pointer, place and fillament.
+		L=(BranchBytes-3*(int)sizeof(void*))/(int)(sizeof(void*)+sizeof(C))>=4 ?
+			(BranchBytes-3*(int)sizeof(void*))/(int)(sizeof(void*)+sizeof(C)) : 4,
+		/// Elements per leaf, besides the parent pointer, place and fillament.
+		M=(LeafBytes-3*(int)sizeof(void*))/(int)sizeof(T)>=4 ?
+			(LeafBytes-3*(int)sizeof(void*))/(int)sizeof(T) : 4
+	};
+};
+
+/// Pool of nodes, which can be shared by many containers (see btree_seq_pool_allocator).
+/** Memory is taken from the system in slabs of slab_size bytes and cut into blocks
+ * in the order of allocation, so the nodes allocated together (a leaf and its new
+ * branch) are close in memory, as with malloc. A freed block goes to the free list
+ * of its size and is taken again by the next allocation of this size. So growing and
+ * shrinking containers do not call malloc, and the blocks have no headers.
+ * The slabs are freed by the destructor only.
+ * Blocks larger than slab_size/4 are taken from operator new.
+ * With huge_pages, the slabs are mappings of whole 2MB pages (on Linux: MAP_HUGETLB,
+ * or transparent huge pages via madvise if none are reserved), so random access to
+ * a large tree, having all its nodes in such a pool, takes fewer TLB misses.
+ * The pool is not synchronized: the containers using it must be changed by one thread
+ * at a time, and parallel_assign must not be used with it. */
+class btree_seq_node_pool
+{
+	enum {max_sizes=16,granularity=16,huge_page=2*1024*1024};
+	struct size_class
+	{
+		size_t size;
+		void *free;
+	};
+	size_class classes[max_sizes];
+	size_t sizes,slab_size,total;
+	char *next,*end;
+	void *slabs;
+	bool mapped;
+	btree_seq_node_pool(const btree_seq_node_pool &);
+	btree_seq_node_pool &operator=(const btree_seq_node_pool &);
+	size_class *find(size_t bytes,bool add)
+	{
+		if(bytes>slab_size/4){
+			return 0;
+		}
+		bytes=(bytes+granularity-1)/granularity*granularity;
+		for(size_t j=0;j<sizes;j++){
+			if(classes[j].size==bytes){
+				return classes+j;
+			}
+		}
+		if(!add||sizes==max_sizes){
+			return 0;
+		}
+		size_class *c=classes+sizes++;
+		c->size=bytes;
+		c->free=0;
+		return c;
+	}
+	//A mapping aligned to huge pages, at first with reserved ones. The aligned part
+	//of a larger mapping is taken otherwise, the rest is unmapped.
+	void *map_slab(size_t bytes)
+	{
+#ifdef __linux__
+#ifdef MAP_HUGETLB
+		void *p=mmap(0,bytes,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+		if(p!=MAP_FAILED){
+			return p;
+		}
+#endif
+		char *q=static_cast<char*>(mmap(0,bytes+huge_page,PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS,-1,0));
+		if(q==MAP_FAILED){
+			throw std::bad_alloc();
+		}
+		size_t shift=(huge_page-reinterpret_cast<size_t>(q)%huge_page)%huge_page;
+		if(shift!=0){
+			munmap(q,shift);
+		}
+		munmap(q+shift+bytes,huge_page-shift);
+#ifdef MADV_HUGEPAGE
+		madvise(q+shift,bytes,MADV_HUGEPAGE);
+#endif
+		return q+shift;
+#else
+		return ::operator new(bytes);
+#endif
+	}
+	void free_slab(void *slab)
+	{
+#ifdef __linux__
+		if(mapped){
+			munmap(slab,slab_size+granularity);
+			return;
+		}
+#endif
+		::operator delete(slab);
+	}
+	//The first granularity bytes of a slab link it to the previous one.
+	//The rest of the current slab is left unused.
+	void grow()
+	{
+		char *slab=static_cast<char*>(mapped?map_slab(slab_size+granularity):
+			::operator new(slab_size+granularity));
+		*reinterpret_cast<void**>(slab)=slabs;
+		slabs=slab;
+		total+=slab_size+granularity;
+		next=slab+granularity;
+		end=next+slab_size;
+	}
+public:
+	/// Creates an empty pool, which takes slabs of slab_size bytes.
+	/** With huge_pages, the slab size is rounded up to a multiple of 2MB. */
+	explicit btree_seq_node_pool(size_t slab=65536,bool huge_pages=false)
+		:sizes(0),slab_size(slab),total(0),next(0),end(0),slabs(0),mapped(huge_pages)
+	{
+		if(mapped){
+			slab_size=(slab+huge_page-1)/huge_page*huge_page-granularity;
+		}
+	}
+	~btree_seq_node_pool()
+	{
+		while(slabs!=0){
+			void *link=*reinterpret_cast<void**>(slabs);
+			free_slab(slabs);
+			slabs=link;
+		}
+	}
+	/// Returns a block of the given size.
+	void *allocate(size_t bytes)
+	{
+		size_class *c=find(bytes,true);
+		if(c==0){
+			return ::operator new(bytes);
+		}
+		void *res=c->free;
+		if(res!=0){
+			c->free=*reinterpret_cast<void**>(res);
+			return res;
+		}
+		if(static_cast<size_t>(end-next)<c->size){
+			grow();
+		}
+		res=next;
+		next+=c->size;
+		return res;
+	}
+	/// Returns a block to the pool, the size must be the same as at allocation.
+	void deallocate(void *p,size_t bytes)
+	{
+		size_class *c=find(bytes,false);
+		if(c==0){
+			::operator delete(p);
+			return;
+		}
+		*reinterpret_cast<void**>(p)=c->free;
+		c->free=p;
+	}
+	/// Returns the number of the free list for the blocks of the given size,
+	/// or -1 if such blocks are not pooled.
+	int size_index(size_t bytes)
+	{
+		size_class *c=find(bytes,true);
+		return (c!=0)?static_cast<int>(c-classes):-1;
+	}
+	/// Returns the number of bytes taken from the system.
+	size_t memory()const{return total;}
+	/// The pool used by the default constructed allocators.
+	/** It is never destroyed, so the containers with static storage can use it. */
+	static btree_seq_node_pool &shared()
+	{
+		static btree_seq_node_pool *pool=new btree_seq_node_pool;
+		return *pool;
+	}
+};
+
+/// Allocator taking the nodes of btree_seq from a btree_seq_node_pool.
+/** The containers with the allocators of the same pool share the memory of their
+ * nodes; the default constructed allocator uses btree_seq_node_pool::shared().
+ * The elements are kept in the nodes, so only the nodes are allocated:
+ * <code> btree_seq_node_pool pool; btree_seq<int,L,M,btree_seq_pool_allocator<int> >
+ * a(btree_seq_pool_allocator<int>(pool)),b(a.get_allocator()); </code>
+ * The containers exchanging nodes (swap, move, concatenate, split) must use the same pool,
+ * and the pool must outlive them. */
+template <typename T>
+class btree_seq_pool_allocator:public std::allocator<T>
+{
+	template <typename U> friend class btree_seq_pool_allocator;
+	btree_seq_node_pool *pool;
+public:
+	template <typename U> struct rebind{typedef btree_seq_pool_allocator<U> other;};
+#if __cplusplus >= 201103L
+	//the pool goes with the nodes, when a container is moved or swapped
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+	typedef std::false_type is_always_equal;
+#endif
+	btree_seq_pool_allocator():pool(&btree_seq_node_pool::shared()){}
+	explicit btree_seq_pool_allocator(btree_seq_node_pool &p):pool(&p){}
+	template <typename U> btree_seq_pool_allocator(const btree_seq_pool_allocator<U> &a)
+		:pool(a.pool){}
+	T *allocate(size_t n,const void* =0){return static_cast<T*>(pool->allocate(n*sizeof(T)));}
+	void deallocate(T *p,size_t n){pool->deallocate(p,n*sizeof(T));}
+	/// Returns the pool of the allocator.
+	btree_seq_node_pool &get_pool()const{return *pool;}
+	template <typename U> bool operator==(const btree_seq_pool_allocator<U> &a)const
+		{return pool==a.pool;}
+	template <typename U> bool operator!=(const btree_seq_pool_allocator<U> &a)const
+		{return pool!=a.pool;}
+};
+
+#if __cplusplus >= 201103L
+/// Node pool shared by all threads, each thread keeping its own cache of free nodes.
+/** The nodes freed by a thread (erase, merging, clear) are taken again by the same
+ * thread without locking. The caches exchange nodes with the shared depot,
+ * a btree_seq_node_pool under a mutex, by magazines of a few dozen nodes:
+ * a thread takes a magazine when its cache is empty, and gives one back when
+ * it keeps two. The cache of a thread goes to the depot when the thread exits.
+ * The memory of the depot is never freed. */
+class btree_seq_thread_cache
+{
+	enum {max_sizes=16,max_known=32,magazine=64};
+	struct depot_type
+	{
+		std::mutex lock;
+		btree_seq_node_pool pool;
+	};
+	//The free nodes of a thread, by the numbers of the free lists of the depot;
+	//known are the sizes seen by the thread with their numbers.
+	struct cache_type
+	{
+		void *free[max_sizes];
+		size_t count[max_sizes],bytes[max_sizes];
+		size_t known,known_bytes[max_known];
+		int known_index[max_known];
+		bool closed;
+	};
+	//Giving the cache back when the thread exits; the nodes freed later go
+	//to the depot directly.
+	struct closer
+	{
+		cache_type *c;
+		explicit closer(cache_type *cache):c(cache){}
+		~closer()
+		{
+			for(int j=0;j<max_sizes;j++){
+				give(*c,j,c->count[j]);
+			}
+			c->closed=true;
+		}
+	};
+	static depot_type &depot()
+	{
+		static depot_type *d=new depot_type;
+		return *d;
+	}
+	static cache_type &cache()
+	{
+		//c has no destructor, so it stays usable when cl has given it back
+		static thread_local cache_type c;
+		static thread_local closer cl(&c);
+		return c;
+	}
+	static int find(cache_type &c,size_t bytes)
+	{
+		for(size_t j=0;j<c.known;j++){
+			if(c.known_bytes[j]==bytes){
+				return c.known_index[j];
+			}
+		}
+		int res;
+		{
+			std::lock_guard<std::mutex> guard(depot().lock);
+			res=depot().pool.size_index(bytes);
+		}
+		if(c.known<max_known){
+			c.known_bytes[c.known]=bytes;
+			c.known_index[c.known++]=res;
+		}
+		if(res>=0){
+			c.bytes[res]=bytes;
+		}
+		return res;
+	}
+	//Moving num nodes of the list j from the cache to the depot.
+	static void give(cache_type &c,int j,size_t num)
+	{
+		std::lock_guard<std::mutex> guard(depot().lock);
+		for(;num>0;num--){
+			void *p=c.free[j];
+			c.free[j]=*reinterpret_cast<void**>(p);
+			c.count[j]--;
+			depot().pool.deallocate(p,c.bytes[j]);
+		}
+	}
+	static void take(cache_type &c,int j)
+	{
+		std::lock_guard<std::mutex> guard(depot().lock);
+		for(size_t k=0;k<magazine;k++){
+			void *p=depot().pool.allocate(c.bytes[j]);
+			*reinterpret_cast<void**>(p)=c.free[j];
+			c.free[j]=p;
+			c.count[j]++;
+		}
+	}
+public:
+	/// Returns a block of the given size.
+	static void *allocate(size_t bytes)
+	{
+		cache_type &c=cache();
+		int j=find(c,bytes);
+		if(j<0){
+			return ::operator new(bytes);
+		}
+		if(c.closed){
+			std::lock_guard<std::mutex> guard(depot().lock);
+			return depot().pool.allocate(bytes);
+		}
+		if(c.free[j]==0){
+			take(c,j);
+		}
+		void *res=c.free[j];
+		c.free[j]=*reinterpret_cast<void**>(res);
+		c.count[j]--;
+		return res;
+	}
+	/// Returns a block, the size must be the same as at allocation.
+	static void deallocate(void *p,size_t bytes)
+	{
+		cache_type &c=cache();
+		int j=find(c,bytes);
+		if(j<0){
+			::operator delete(p);
+			return;
+		}
+		*reinterpret_cast<void**>(p)=c.free[j];
+		c.free[j]=p;
+		if(++c.count[j]>=(c.closed?1:2*magazine)){
+			give(c,j,c.closed?1:magazine);
+		}
+	}
+};
+
+/// Allocator taking the nodes of btree_seq from btree_seq_thread_cache (C++11).
+/** It has no state, so the containers can be moved between threads freely.
+ * Suits many threads, each changing its own containers. */
+template <typename T>
+class btree_seq_thread_cache_allocator:public std::allocator<T>
+{
+public:
+	template <typename U> struct rebind{typedef btree_seq_thread_cache_allocator<U> other;};
+	btree_seq_thread_cache_allocator(){}
+	template <typename U> btree_seq_thread_cache_allocator(const btree_seq_thread_cache_allocator<U> &){}
+	T *allocate(size_t n,const void* =0)
+		{return static_cast<T*>(btree_seq_thread_cache::allocate(n*sizeof(T)));}
+	void deallocate(T *p,size_t n){btree_seq_thread_cache::deallocate(p,n*sizeof(T));}
+	template <typename U> bool operator==(const btree_seq_thread_cache_allocator<U> &)const{return true;}
+	template <typename U> bool operator!=(const btree_seq_thread_cache_allocator<U> &)const{return false;}
+};
+#endif
+
 /// The fast sequence container, which behaves like std::vector takes O(log(N)) to insert/delete elements.
 /** This container implements most of std::vector's members. It inserts/deletes elements
  * much faster than any standart container. However, random access to the element takes O(log(N)) time as well.
@@ -53,60 +911,70 @@ namespace ___alexkupri_helpers
  * require practically constant time per element.
  * The implementation is based on btrees.
  * @tparam T the type of the element
- * @tparam L maximal number of children per branch, default 30 minimum 4. You can change it for better performance.
- * @tparam M maximal number of elements per leaf, default 60 minimum 4. You can change it for better performance.
- * @tparam A allocator.
+ * @tparam L maximal number of children per branch, minimum 4, default is computed by btree_seq_nodes<T>
+ * (30 on 64-bit platforms). You can change it for better performance.
+ * @tparam M maximal number of elements per leaf, minimum 4, default is computed by btree_seq_nodes<T>
+ * (250 for int). You can change it for better performance.
+ * @tparam A allocator, for example std::pmr::polymorphic_allocator<T> (C++17).
+ * @tparam P policy, see btree_seq_default_policy.
 */
-template <typename T,int L=30,int M=60,typename A=std::allocator<T> >
+template <typename T,int L=btree_seq_nodes<T>::L,int M=btree_seq_nodes<T>::M,typename A=std::allocator<T>,
+	typename P=btree_seq_default_policy>
 class btree_seq
 {
 public:
 	///The last template parameter, allocator.
 	typedef A allocator_type;
 	///Value type, T (the first template parameter).
-	typedef typename A::value_type value_type;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::value_type value_type;
 	///Reference type, T&.
-	typedef typename A::reference reference;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::reference reference;
 	///Constant reference type, const T&.
-	typedef typename A::const_reference const_reference;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::const_reference const_reference;
 	///Pointer type, T*.
-	typedef typename A::pointer pointer;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::pointer pointer;
 	///Constant pointer type, const T*.
-	typedef typename A::const_pointer const_pointer;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::const_pointer const_pointer;
 	///Unsigned integer type, size_t (unsigned int).
-	typedef typename A::size_type size_type;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::size_type size_type;
 	///Signed integer type, ptr_diff_t (int).
-	typedef typename A::difference_type difference_type;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::difference_type difference_type;
 	///Signed integer type, ptr_diff_t (int).
-	typedef typename A::difference_type diff_type;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::difference_type diff_type;
 private:
+	typedef ___alexkupri_helpers::my_alloc_traits<A> alloc_traits;
 	//data types
 	//In the whole library Node* can be cast to either Branch* or Leaf*.
 	//This is determined entirely via depth variable.
 	struct Branch;
-	struct Node
+	struct Node:public ___alexkupri_helpers::my_node_refs<size_type,P::copy_on_write>
 	{
 		Branch *parent;
+		//index in parent->children, valid if parent!=0
+		size_type place;
 	};
-	struct Branch:public Node
+	typedef typename P::counter_type counter_type;
+	//nums[j] is the number of elements in child j, or in children 0..j
+	//if P::prefix_counts is set. The order of fields depends on P::node_alignment.
+	struct Branch:public ___alexkupri_helpers::my_branch_layout<Node,size_type,counter_type,L,P::node_alignment!=0>
 	{
-		Node* children[L];
-		size_type nums[L];
-		size_type fillament;
 	};
-	struct Leaf:public Node
+	struct Leaf:public ___alexkupri_helpers::my_leaf_layout<Node,value_type,size_type,M,P::node_alignment!=0>
 	{
-		value_type elements[M];
-		size_type fillament;
 	};
-    typedef typename allocator_type::template rebind<Branch>::other Branch_alloc_type;
-    typedef typename allocator_type::template rebind<Leaf>::other Leaf_alloc_type;
+    typedef ___alexkupri_helpers::my_node_pool<Branch,
+		typename ___alexkupri_helpers::my_node_allocator<Branch,A,P::node_alignment>::type> Branch_alloc_type;
+    typedef ___alexkupri_helpers::my_node_pool<Leaf,
+		typename ___alexkupri_helpers::my_node_allocator<Leaf,A,P::node_alignment>::type> Leaf_alloc_type;
 	allocator_type T_alloc;
 	Branch_alloc_type branch_alloc;
 	Leaf_alloc_type leaf_alloc;
 	//Data
 	Node *root;
 	size_type depth,count;
+	//Changed by every operation, which changes the structure of the tree (hints become invalid).
+	size_type version;
+	void modified(){++version;}
 	//Element helper functions
 	void move_elements_inc(pointer dst,pointer src,size_type num);
 	void move_elements_dec(pointer dst,pointer limit,size_type num);
@@ -124,6 +992,11 @@ private:
 		std::random_access_iterator_tag){return last-first;}
 	void burn_elements(pointer ptr,size_type num);
 	//branch helpers
+	static size_type child_num(const Branch *b,size_type idx)
+		{return (P::prefix_counts&&idx)?b->nums[idx]-b->nums[idx-1]:b->nums[idx];}
+	static void add_to_child(Branch *b,size_type idx,diff_type diff);
+	static void shift_count(Branch *b,size_type left,diff_type diff);
+	static size_type find_in_branch(const Branch *b,size_type &pos);
 	void insert_children(Branch *b,size_type idx,size_type num);
 	void delete_children(Branch *b,size_type idx,size_type num);
 	size_type move_children(Branch *dst,size_type idst,Branch *src,size_type isrc,size_type num);
@@ -143,6 +1016,22 @@ private:
 	size_type  find_leaf(Leaf *&l,size_type pos)const;
 	size_type  find_leaf(Node *&l,size_type pos,difference_type increment,size_type depth_lim=0);
 	static size_type  find_child(Branch *b,Node* c);
+	static size_type  count_leaves(Node *n,size_type dep);
+	//prefetch helpers (P::prefetch)
+	static void prefetch_branch(const Node *n)
+	{
+		if(P::prefetch){
+			___alexkupri_helpers::my_prefetch_range(static_cast<const Branch*>(n)->nums,sizeof(counter_type)*L);
+		}
+	}
+	static void prefetch_leaf(const Node *n)
+	{
+		if(P::prefetch){
+			___alexkupri_helpers::my_prefetch_range(static_cast<const Leaf*>(n)->elements,sizeof(value_type)*M);
+		}
+	}
+	static Leaf *next_leaf(Branch *&b,size_type &idx);
+	static Leaf *prev_leaf(Branch *&b,size_type &idx);
 	//some initialization functions
 	void init_tree();
 	void increase_depth(Branch *new_branch);
@@ -168,6 +1057,116 @@ private:
 	void insert_leaves(Leaf **l,size_type num_leaves,diff_type num_elems,size_type pos);
 	template <class InputIterator>
 		Leaf* insert_whole_leaves(size_type startpos,size_type &pos,InputIterator first,InputIterator last,Leaf *last_leaf);
+	//bulk loading helpers
+	template <class InputIterator>
+		bool insert_built_tree(size_type pos,InputIterator first,InputIterator last,diff_type n,
+			std::random_access_iterator_tag);
+	template <class InputIterator>
+		bool insert_built_tree(size_type,InputIterator,InputIterator,diff_type,
+			std::input_iterator_tag){return false;}
+	template <class InputIterator>
+		void build_tree(InputIterator first,InputIterator last,size_type n);
+	//Linking the leaves of a tree of n elements, given from left to right, into the levels
+	//of branches. The shape depends on n only: all the nodes of a level have the same
+	//number of children (+-1).
+	class level_builder
+	{
+		enum {max_levels=sizeof(size_type)*8};
+		btree_seq *tree;
+		size_type count,dep;
+		//the node j of a level d has quot[d]+1 children if j<rem[d], quot[d] otherwise
+		size_type nodes[max_levels],quot[max_levels],rem[max_levels];
+		//for each level: open branch, number of closed branches, elements in the open branch
+		Branch *open[max_levels];
+		size_type built[max_levels],sums[max_levels];
+		Node *top;
+	public:
+		level_builder(btree_seq *t,size_type n,size_type fill=M);
+		size_type leaves()const{return nodes[0];}
+		size_type leaf_size(size_type j)const{return quot[0]+((j<rem[0])?1:0);}
+		size_type leaf_start(size_type j)const{return j*quot[0]+((j<rem[0])?j:rem[0]);}
+		//Linking the next leaf; if an exception occurs, the leaf is destroyed.
+		void add_leaf(Leaf *l);
+		//Destroying the linked part after an exception.
+		void abandon();
+		//Number of branches of the tree.
+		size_type branches()const;
+		//Making the built tree the contents of the container.
+		void finish();
+	};
+#if __cplusplus >= 201103L
+	template <class RandomAccessIterator>
+		void build_leaves(const level_builder &lb,Leaf **leaves,size_type from,size_type to,
+			RandomAccessIterator first,RandomAccessIterator last,std::exception_ptr &error);
+#endif
+	//Number of leaves for n elements filled up to fill, all of them at least half-filled.
+	static size_type leaves_for(size_type n,size_type fill);
+	void repack(size_type fill,bool relocate);
+	//Exchanging the trees, the allocators must be equal.
+	void swap_nodes(btree_seq &that);
+	void swap_trees(btree_seq &that,___alexkupri_helpers::my_bool<true>);
+	void swap_trees(btree_seq &that,___alexkupri_helpers::my_bool<false>){swap_nodes(that);}
+	void swap_elements(btree_seq &that);
+	void compact_branch(Branch *b,size_type fill);
+	size_type branch_start(size_type pos,size_type &n);
+	void burn_nodes(Node *n,size_type dep);
+	void burn_branches(Node *n,size_type dep);
+	void burn_leaf_elements(Node *n,size_type dep);
+	Node *clone_nodes(const Node *n,size_type dep);
+	void clone_tree(const btree_seq<T,L,M,A,P> &that)
+	{
+		if(that.count!=0){
+			//the nodes are shared only if they can be freed by either allocator
+			if((P::copy_on_write!=0)&&(T_alloc==that.T_alloc)){
+				root=that.root;
+				root->add_ref();
+			}else{
+				root=clone_nodes(that.root,that.depth);
+				root->parent=0;
+				root->place=0;
+			}
+			depth=that.depth;
+			count=that.count;
+		}
+	}
+	//copy-on-write helpers (P::copy_on_write)
+	Node *copy_node(Node *n,size_type dep);
+	void own_nodes(Node *n,size_type dep,size_type first,size_type last);
+	//Child j of b is made owned by this tree, if it is shared; dep is its depth.
+	//The parent pointer of a shared node is not valid, so it is set here.
+	Node *own_child(Branch *b,size_type j,size_type dep)
+	{
+		Node *c=b->children[j];
+		if(P::copy_on_write!=0){
+			if(c->use_count()>1){
+				c=copy_node(c,dep);
+				b->children[j]=c;
+			}
+			c->parent=b;
+			c->place=j;
+		}
+		return c;
+	}
+	//The nodes containing elements [first,last) are made owned by this tree.
+	void own_range(size_type first,size_type last)
+	{
+		if((P::copy_on_write!=0)&&(first<last)&&(first<count)){
+			if(root->use_count()>1){
+				root=copy_node(root,depth);
+			}
+			root->parent=0;
+			root->place=0;
+			own_nodes(root,depth,first,last<count?last:count);
+		}
+	}
+	//Finding the leaf for reading, or for writing through an iterator.
+	size_type find_leaf_for(Leaf *&l,size_type pos,const_pointer)const
+		{return find_leaf(l,pos);}
+	size_type find_leaf_for(Leaf *&l,size_type pos,pointer)const
+	{
+		const_cast<btree_seq*>(this)->own_range(pos,pos+1);
+		return find_leaf(l,pos);
+	}
 	class FillIterator
 	{
 		const_pointer ptr;
@@ -209,27 +1208,38 @@ private:
 		btree_seq &aka;
 	public:
 		erase_helper(btree_seq &akaaka):last_leaf(0),leaves(0),aka(akaaka){}
-		void decrement_value(size_type &a,size_type b){a-=b;}
+		void decrement_value(Branch *b,size_type idx,size_type diff)
+			{add_to_child(b,idx,-static_cast<diff_type>(diff));}
 		bool shift_array(){return true;}
 		bool process_leaf(Leaf *l,size_type start,size_type end);
+		//a whole subtree is destroyed at once, or only released if it is shared
+		bool process_subtree(Node *n,size_type dep)
+		{
+			aka.burn_nodes(n,dep);
+			leaves++;
+			last_leaf=0;
+			return true;
+		}
 		Leaf *get_last_leaf(){return last_leaf;}
 		size_type num_leaves(){return leaves;}
 	};
-	template<typename V>
+	//E is T, or const T for the const visit
+	template<typename V,typename E>
 	class visitor_helper
 	{
 		V &v;
 		size_type iters;
 	public:
 		visitor_helper(V &vv):v(vv),iters(0){};
-		void decrement_value(size_type &,size_type){}
+		void decrement_value(Branch *,size_type,size_type){}
 		bool shift_array(){return false;}
+		bool process_subtree(Node *,size_type){return false;}
 		bool process_leaf(Leaf *l,size_type st,size_type fin);
 		size_type get_iters(){return iters;}
 	};
 	//attach and detach helpers
-	void detach_some(btree_seq<T,L,M,A> &that,Branch *b,size_type dep,bool last);
-	void insert_tree(btree_seq<T,L,M,A> &that,bool last);
+	void detach_some(btree_seq<T,L,M,A,P> &that,Branch *b,size_type dep,bool last);
+	void insert_tree(btree_seq<T,L,M,A,P> &that,bool last);
 	//assign helpers
 	template <class Integer>
 		void impl_insert(size_type pos,Integer n,Integer val,___alexkupri_helpers::my_true_type)
@@ -247,6 +1257,7 @@ private:
 		void output_node(output_stream &o,Node* c,size_type tabs,size_type depth);
 	static void my_assert(bool,const char*);
 	void assert_range(size_type n);
+	void assert_length(size_type n)const;
 public:
 	///Iterator template for const_iterator and iterator
 	/** This is a lazy implementation of iterator. In other words,
@@ -413,47 +1424,166 @@ public:
 	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 	///Modifying reverse random-access iterator.
 	typedef std::reverse_iterator<iterator> reverse_iterator; 
+	///Remembered path to the last accessed leaf for finger search.
+	/** The functions taking a hint start the search from the deepest
+	 * remembered node containing the position, and remember the new path.
+	 * Each reader thread may use its own hint with the same container.
+	 * Operations changing the structure of the container make the hints
+	 * invalid; an invalid hint is detected and refilled from the root.
+	 * A hint must not be used after its container is destroyed. */
+	class appender;
+	friend class appender;
+	class hint
+	{
+		friend class btree_seq;
+		enum {max_levels=8};
+		const btree_seq *tree;
+		size_type version;
+		//number of remembered levels, level 0 is the leaf
+		size_type levels;
+		//node at each level and range [first,last) of positions in it
+		Node *nodes[max_levels];
+		size_type first[max_levels],last[max_levels];
+	public:
+		///Empty hint.
+		hint():tree(0),version(0),levels(0){}
+		///Forgetting the path.
+		void reset(){tree=0;}
+	};
+	///Fast appending of many elements to the end of a container.
+	/** The appender keeps the rightmost leaf and fills it completely, without
+	 * searching from the root. The counters in the branches above the leaf and
+	 * size() are updated once per leaf, when it is full or when the appender
+	 * is flushed; then a new leaf is linked to the right.
+	 * The container must not be used while the appender holds unflushed
+	 * elements, call flush() or destroy the appender first.
+	 * Complexity: O(1) amortized per element, O(log(N)) per leaf. */
+	class appender
+	{
+		friend class btree_seq;
+		btree_seq *tree;
+		Leaf *leaf;
+		//number of elements in leaf, leaf->fillament is updated by commit()
+		size_type fill;
+		//grow() is called when fill reaches end: M, or less at max_size()
+		size_type end;
+		void grow();
+		void commit();
+		appender(const appender &);
+		appender &operator=(const appender &);
+	public:
+		///Appender for container t, the rightmost leaf is found on the first push_back.
+		explicit appender(btree_seq &t):tree(&t),leaf(0),fill(M),end(M){}
+		///Flushes the elements.
+		~appender(){flush();}
+		///Adds element to the end of the container.
+		void push_back(const value_type &val)
+		{
+			if(fill==end){
+				grow();
+			}
+			alloc_traits::construct(tree->T_alloc,leaf->elements+fill,val);
+			fill++;
+		}
+		#if __cplusplus >= 201103L
+		///Constructs the element at the end of the container. (C++11)
+		template <class... Args>
+		void emplace_back(Args&&... args)
+		{
+			if(fill==end){
+				grow();
+			}
+			alloc_traits::construct(tree->T_alloc,leaf->elements+fill,std::forward<Args>(args)...);
+			fill++;
+		}
+		#endif
+		///Makes the appended elements visible in the container and rebalances its last leaf.
+		void flush();
+	};
+private:
+	typedef typename ___alexkupri_helpers::my_select<P::finger!=0,hint,
+		___alexkupri_helpers::my_no_finger>::type finger_type;
+	mutable finger_type finger;
+	#if __cplusplus >= 201103L
+	//The version for snapshots, replaced by publish() (P::copy_on_write==2).
+	//It holds a reference to its root.
+	struct publication
+	{
+		std::mutex lock;
+		Node *root;
+		size_type depth,count;
+		publication():root(),depth(0),count(0){}
+	};
+	mutable typename ___alexkupri_helpers::my_select<P::copy_on_write==2,publication,
+		___alexkupri_helpers::my_no_publication>::type published;
+	void unpublish(publication &p)
+	{
+		if(p.count!=0){
+			burn_nodes(p.root,p.depth);
+		}
+	}
+	void unpublish(___alexkupri_helpers::my_no_publication &){}
+	//The published version goes with the tree, when the tree moves to another container.
+	void swap_published(publication &p)
+	{
+		if(&p==&published){
+			return;
+		}
+		std::lock(published.lock,p.lock);
+		std::lock_guard<std::mutex> guard1(published.lock,std::adopt_lock),guard2(p.lock,std::adopt_lock);
+		std::swap(published.root,p.root);
+		std::swap(published.depth,p.depth);
+		std::swap(published.count,p.count);
+	}
+	void swap_published(___alexkupri_helpers::my_no_publication &){}
+	#endif
+	size_type find_leaf(Leaf *&l,size_type pos,hint &h)const;
+	size_type find_leaf(Leaf *&l,size_type pos,___alexkupri_helpers::my_no_finger &)const
+		{return find_leaf(l,pos);}
+public:
 	///Empty container constructor.
 	/** Constructs an empty container with no elements.
 	 *  Complexity: constant.
 	 * 	@param alloc allocator */
 	explicit btree_seq(const allocator_type &alloc=allocator_type())
-		:T_alloc(alloc),branch_alloc(alloc),leaf_alloc(alloc),root(),count(0)
+		:T_alloc(alloc),branch_alloc(alloc),leaf_alloc(alloc),root(),depth(0),count(0),version(0)
 	{
 	};
 	///Copy constructor.
-	/** Copies all elements from another container.
-	 *  Complexity: O(N*log(N)), N=that.size().
+	/** Copies all elements from another container, the nodes have the same shape.
+	 *  The allocator is select_on_container_copy_construction of that allocator (C++11).
+	 *  With P::copy_on_write, the nodes are shared instead, if the allocators are equal.
+	 *  Complexity: O(N), N=that.size(), or constant with P::copy_on_write.
 	 * 	@param that another container to be copied */
-	btree_seq(const btree_seq<T,L,M,A> &that)
-		:T_alloc(that.T_alloc),branch_alloc(that.T_alloc),leaf_alloc(that.T_alloc),
-		 root(),count(0)
+	btree_seq(const btree_seq<T,L,M,A,P> &that)
+		:T_alloc(alloc_traits::select_on_copy(that.T_alloc)),branch_alloc(T_alloc),leaf_alloc(T_alloc),
+		 root(),depth(0),count(0),version(0)
 	{
-		const_iterator first=that.begin(),last=that.end();
-		insert(0,first,last);
+		clone_tree(that);
 	}
 	///Fill constructor.
 	/** Constructs a container with n elements, each of them is copy of val.
-	 *  Complexity: O(n*log(n)).
+	 *  Complexity: O(n).
 	 * 	@param n number of elements
 	 * 	@param val fill value
 	 * 	@param alloc allocator */
 	explicit btree_seq(size_type n,const value_type &val,
 			const allocator_type &alloc=allocator_type())
-		:T_alloc(alloc),branch_alloc(alloc),leaf_alloc(alloc),root(),count(0)
+		:T_alloc(alloc),branch_alloc(alloc),leaf_alloc(alloc),root(),depth(0),count(0),version(0)
 	{
 		fill(0,n,val);
 	}
 	///Range constructor
 	/** Constructs a container filled with elements from range [first,last).
-	 * Complexity: O(N*log(N)), N=dist(last,first).
+	 * Complexity: O(N), N=dist(last,first), if Iterator is a random access iterator,
+	 * otherwise O(N*log(N)).
 	 * @param first first position in a range
 	 * @param last  last  position in a range
 	 * @param alloc allocator	 */
 	template <typename Iterator>
 	btree_seq(Iterator first,Iterator last,
 		const allocator_type &alloc=allocator_type())
-		:T_alloc(alloc),branch_alloc(alloc),leaf_alloc(alloc),root(),count(0)
+		:T_alloc(alloc),branch_alloc(alloc),leaf_alloc(alloc),root(),depth(0),count(0),version(0)
 	{
 		typename ___alexkupri_helpers::my_is_integer<Iterator>::__type is_int_type;
 		impl_insert(0,first,last,is_int_type);
@@ -464,13 +1594,29 @@ public:
 	/** Creates a copy of container and leaves that container in valid (empty) state.
 	 * @param that container to copy
 	 * @param alloc allocator	 */
-	btree_seq(btree_seq<T,L,M,A> &&that, const allocator_type &alloc=allocator_type()):T_alloc(alloc)
+	btree_seq(btree_seq<T,L,M,A,P> &&that)
+		:T_alloc(that.T_alloc),branch_alloc(that.T_alloc),leaf_alloc(that.T_alloc),
+		 root(),depth(0),count(0),version(0)
+	{
+		swap_nodes(that);
+		swap_published(that.published);
+	}
+	///Move constructor with allocator (C++11)
+	/** Takes the nodes of that, if alloc is equal to the allocator of that.
+	 * Otherwise the elements are moved one by one into new nodes.
+	 * Complexity: constant, or O(N) if the allocators differ.
+	 * @param that container to move from, it becomes empty
+	 * @param alloc allocator to use */
+	btree_seq(btree_seq<T,L,M,A,P> &&that,const allocator_type &alloc)
+		:T_alloc(alloc),branch_alloc(alloc),leaf_alloc(alloc),root(),depth(0),count(0),version(0)
 	{
-		root=that.root;
-		count=that.count;
-		depth=that.depth;
-		that.count=0;
-		that.depth=0;
+		if(T_alloc==that.T_alloc){
+			swap_nodes(that);
+			swap_published(that.published);
+		}else{
+			assign(std::make_move_iterator(that.begin()),std::make_move_iterator(that.end()));
+			that.clear();
+		}
 	}
 
 	///Initializer list constructor (C++11)
@@ -485,8 +1631,15 @@ public:
 
 	///Destructor
 	/** Deletes the contents and frees memory.
-	 * Complexity: O(N*log(N)).*/
-	~btree_seq(){erase(0,count);}
+	 * Complexity: O(N); no node is freed if the nodes are left to an arena, then O(1)
+	 * if T is trivially destructible (see clear).*/
+	~btree_seq()
+	{
+		clear();
+	#if __cplusplus >= 201103L
+		unpublish(published);
+	#endif
+	}
 	/** @name Iterators
 	 */
 	///@{
@@ -546,8 +1699,9 @@ public:
 	 * @param pos index of the element*/
 	reference operator [](size_type pos)
 	{
+		own_range(pos,pos+1);
 		Leaf *l=(Leaf*)root;
-		size_type found=depth?find_leaf(l,pos):pos;
+		size_type found=depth?find_leaf(l,pos,finger):pos;
 		T *ptr=l->elements;
 		return *(ptr+found);
 	}
@@ -559,12 +1713,69 @@ public:
 	const_reference operator [](size_type pos)const
 	{
 		Leaf *l=(Leaf*)root;
-		size_type found=depth?find_leaf(l,pos):pos;
+		size_type found=depth?find_leaf(l,pos,finger):pos;
 		const T *ptr=l->elements;
 		return *(ptr+found);
 	}
+	///Access to element using a hint
+	/** No range check is done.
+	 * Complexity: O(log(d)), d is the distance from the previous position
+	 * accessed with h, or O(log(N)) if h is not valid for this container.
+	 * @param pos index of the element
+	 * @param h hint, remembers the path to pos */
+	reference get(size_type pos,hint &h)
+	{
+		own_range(pos,pos+1);
+		Leaf *l=(Leaf*)root;
+		size_type found=find_leaf(l,pos,h);
+		T *ptr=l->elements;
+		return *(ptr+found);
+	}
+	///Constant access to element using a hint
+	/** See get(size_type,hint&).
+	 * @param pos index of the element
+	 * @param h hint, remembers the path to pos */
+	const_reference get(size_type pos,hint &h)const
+	{
+		Leaf *l=(Leaf*)root;
+		size_type found=find_leaf(l,pos,h);
+		const T *ptr=l->elements;
+		return *(ptr+found);
+	}
+	///Reading the elements at a batch of positions.
+	/** Copies the elements at positions [first,last) to out, in the same order.
+	 * The positions are found in one pass: each search starts from the lowest
+	 * common ancestor of the previous leaf and the new position (as with a hint),
+	 * so ascending positions share the upper part of their paths.
+	 * Positions in any order are correct, but ascending ones are fast.
+	 * No range check is done.
+	 * Complexity: O(k+k*log(N/k)) for k ascending positions.
+	 * @param first first of the positions
+	 * @param last position iterator behind the last one
+	 * @param out output iterator for the elements
+	 * @return out behind the last written element */
+	template <class PosIterator,class OutputIterator>
+		OutputIterator gather(PosIterator first,PosIterator last,OutputIterator out)const;
+	///Writing the elements at a batch of positions.
+	/** Assigns the values to the elements at positions [first,last), in the same order.
+	 * See gather for the way the positions are found.
+	 * No range check is done.
+	 * Complexity: O(k+k*log(N/k)) for k ascending positions.
+	 * @param first first of the positions
+	 * @param last position iterator behind the last one
+	 * @param values input iterator of the values
+	 * @return values behind the last used value */
+	template <class PosIterator,class InputIterator>
+		InputIterator scatter(PosIterator first,PosIterator last,InputIterator values);
 	///Number of elements in container.
 	size_type size()const{return count;}
+	///Maximal number of elements, limited by the counter type of the policy.
+	/** Insertions beyond it throw std::length_error. */
+	size_type max_size()const
+	{
+		return static_cast<size_type>(static_cast<counter_type>(-1))<static_cast<size_type>(-1)?
+			static_cast<size_type>(static_cast<counter_type>(-1)):static_cast<size_type>(-1);
+	}
 	///Access to element with range check
 	/** Returns a reference to the element at position pos.
 	 * Complexity: O(log(N)).
@@ -609,6 +1820,15 @@ public:
 	 * @return the index of the first element when v() returned true, or end if v() never returned true*/
 	template<typename V>
 		size_type visit(size_type first,size_type last,V& v);
+	/// Sequential search on the range of a constant container.
+	/** The same as visit, but v() gets constant elements. With P::copy_on_write,
+	 * the nodes shared with other containers are read in place, not copied.
+	 * @param first the first element on which visitor should be called
+	 * @param last the element beyond the last element on which visitor should be called
+	 * @param v the visitor class, which must have 'bool operator(const element&)'
+	 * @return the index of the first element when v() returned true, or end if v() never returned true*/
+	template<typename V>
+		size_type visit(size_type first,size_type last,V& v)const;
 	///@}
 	/** @name Modifying certain elements of the sequence
 	 */
@@ -625,7 +1845,7 @@ public:
 	   Leaf *l;
 	   size_type found=prepare_leaf_for_inserting(pos,1,l,0);
 	   try{
-		   T_alloc.construct(l->elements+found,val);
+		   alloc_traits::construct(T_alloc,l->elements+found,val);
 	   }catch(...){
 		   undo_preparing_to_insert(pos,1,l,0,found);
 		   throw;
@@ -634,6 +1854,9 @@ public:
 	/// Native function for inserting a range of elements.
 	/** Inserts the range [first,last) of elements into the given position.
 	 * Complexity: O((N+M)*log(N+M)), N-existing elements, M - new ones.
+	 * If InputIterator is a random access iterator and the container is empty,
+	 * or pos is 0 or size(), the new elements are loaded into a new tree
+	 * bottom-up, which takes O(M+log(N)).
 	 * @param pos position to insert
 	 * @param first first element to insert
 	 * @param last element behind the last element to insert */
@@ -734,6 +1957,23 @@ public:
 		FillIterator first(&val,0),last(&val,repetition);
 		insert(pos,first,last);
 	}
+	/// Native function for inserting a batch of elements at different positions.
+	/** Inserts the values before the positions [first,last), which are given in
+	 * the sequence before the batch and must be ascending; the values for equal
+	 * positions are inserted in the same order. The result is the same as
+	 * inserting values[j] at positions[j]+j one by one, but the insertions into
+	 * one leaf are done with a single search and a single shift of its elements,
+	 * and the leaf is split at most once per M insertions. The searches go on
+	 * from the previous leaf, as with a hint (see gather).
+	 * If an exception is thrown, some first insertions of the batch are done:
+	 * values[j] for j less than the growth of size(), at their positions.
+	 * Complexity: O(k+g*log(N)) for k insertions into g different leaves.
+	 * @param first first of the positions
+	 * @param last position iterator behind the last one
+	 * @param values input iterator of the values
+	 * @return values behind the last used value */
+	template <class PosIterator,class InputIterator>
+		InputIterator insert_batch(PosIterator first,PosIterator last,InputIterator values);
 	/// Resize container so that it contains n elements.
 	/** If n is greater than container size, copies of the val are added to the end.
 	 *  If n is less than container size, some elements at the end of container are deleted. */
@@ -744,6 +1984,19 @@ public:
 	 * @param first index of the first element to erase
 	 * @param last index of the last element to erase + 1 */
 	void erase(size_type first,size_type last);
+	/// Native function for erasing elements satisfying a predicate.
+	/** Erases the elements of [first,last), for which pred returns true. The kept elements
+	 * are shifted towards first leaf by leaf in one sweep (by assignment, like std::remove_if),
+	 * then the tail is erased at once, so that the counts are rebuilt and the tree is rebalanced
+	 * only once. If pred throws, the elements already checked are erased or kept, and the
+	 * rest of the range is unchanged.
+	 * Complexity: O(last-first+log(N)).
+	 * @param first index of the first element to check
+	 * @param last index of the last element to check + 1
+	 * @param pred the predicate, which must have 'bool operator(element&)'
+	 * @return the number of erased elements */
+	template<typename Pred>
+		size_type erase_if(size_type first,size_type last,Pred pred);
 	/// Compatible function for erasing one element.
 	/** Erase the element at position pos.
 	 * Complexity: O(log(N)).
@@ -770,7 +2023,7 @@ public:
 		return iterator_at(first_position);
 	}
 	/// Adds element to the end of the sequence.
-	/** Complexity: O(log(N))	 */
+	/** Complexity: O(log(N)). Use appender for adding many elements.	 */
 	void push_back(const value_type &val)
 		{	insert(count,val);	}
 	/// Adds element to the beginning of the sequence.
@@ -808,7 +2061,7 @@ public:
 		Leaf *l;
 		size_type found=prepare_leaf_for_inserting(pos,1,l,0);
 		try{
-			T_alloc.construct(l->elements+found,std::forward<Args>(args)...);
+			alloc_traits::construct(T_alloc,l->elements+found,std::forward<Args>(args)...);
 		}catch(...){
 			undo_preparing_to_insert(pos,1,l,0,found);
 			throw;
@@ -848,32 +2101,60 @@ public:
 	///@{
 
 	///Assign content
-	/** Deletes old contents and replaces it with copy of contents of that.
-	 * Complexity: O(N*log(N))+O(M*log(M)), N=this->size(), M=that.size().
+	/** Deletes old contents and replaces it with copy of contents of that
+	 * (shares the nodes of that with P::copy_on_write).
+	 * Complexity: O(N*log(N))+O(M), N=this->size(), M=that.size().
 	 * @param that container to be assigned	 */
-	btree_seq &operator=(const btree_seq<T,L,M,A> &that)
+	btree_seq &operator=(const btree_seq<T,L,M,A,P> &that)
 	{
-		const_iterator first=that.begin(),last=that.end();
-		clear();
-		insert(0,first,last);
+		if(this!=&that){
+			clear();
+			modified();
+			clone_tree(that);
+		}
 		return *this;
 	}
 	/// Swaps contents of two containers.
-	/** Complexity: constant.
+	/** The nodes are exchanged, if the allocator propagates on swap (then the
+	 * allocators are exchanged too) or the allocators are equal. Otherwise
+	 * the elements are moved one by one, each container keeps its allocator.
+	 * Complexity: constant, or O(N+that.size()) if the allocators differ.
 	 * @param that container to swap with */
-	void swap(btree_seq<T,L,M,A> &that);
+	void swap(btree_seq<T,L,M,A,P> &that);
 	/// Erases all contents of the container.
-	/** Complexity: O(N*log(N)) */
-	void clear(){erase(0,count);}
+	/** The nodes are destroyed bottom-up, each one once, without updating the counters
+	 * or rebalancing. With P::copy_on_write, the nodes shared with other containers
+	 * are only released. If the nodes are taken from a std::pmr::monotonic_buffer_resource
+	 * and P::copy_on_write is 0, the nodes are left to the arena, only the elements
+	 * are destroyed (nothing is done if T is trivially destructible).
+	 * Complexity: O(N), or O(N/M) if T is trivially destructible, O(1) in an arena
+	 * if T is trivially destructible */
+	void clear()
+	{
+		if(count!=0){
+			modified();
+			//the nodes are not freed, if they go away with their arena and are not shared
+			if((P::copy_on_write==0)&&___alexkupri_helpers::my_arena<A>::check(T_alloc)){
+				if(!___alexkupri_helpers::my_trivial_destroy<T,A>::value){
+					burn_leaf_elements(root,depth);
+				}
+			}else{
+				burn_nodes(root,depth);
+			}
+			count=0;
+			depth=0;
+		}
+	}
 	/// Replaces the whole contents with n copies of val.
 	/** Erases contents of the container, then fills it with n copies of val.
-	 *  Complexity: O((n+M)*log(n+M)), M - existing elements, n - new ones
+	 *  Complexity: O(M*log(M)+n), M - existing elements, n - new ones
 	 * @param n new size of container
 	 * @param val element to clone */
 	void assign(size_type n,const value_type &val);
 	/// Replaces the whole contents with a range.
 	/** Erases contents of the container, then fills it with a copy of range [first,last).
-	 * Complexity: O((n+M)*log(n+M)), M - existing elements, n - new ones
+	 * Complexity: O(M*log(M)+n), M - existing elements, n - new ones,
+	 * if InputIterator is a random access iterator, otherwise O((n+M)*log(n+M)).
 	 * @param first first element to be inserted
 	 * @param last element behind the last element to be inserted */
 	template <class InputIterator>
@@ -883,6 +2164,21 @@ public:
 		clear();
 		impl_insert(0,first,last,is_int_type);
 	}
+#if __cplusplus >= 201103L
+	/// Replaces the whole contents with a range, filling the leaves in parallel.
+	/** Erases contents of the container, then fills it with a copy of range [first,last).
+	 * The leaves are allocated and filled by the given number of threads (the calling
+	 * one included), each taking a contiguous part of them; then the branches are
+	 * linked in the calling thread. The tree has the same structure as after assign.
+	 * The allocator and the copy constructor of T must be safe to use from several threads.
+	 * If an exception is thrown, the container is left empty.
+	 * Complexity: O(M*log(M)+n/threads+n/M), M - existing elements, n - new ones.
+	 * @param first first element to be inserted
+	 * @param last element behind the last element to be inserted
+	 * @param threads number of threads, 0 for std::thread::hardware_concurrency() */
+	template <class RandomAccessIterator>
+		void parallel_assign(RandomAccessIterator first,RandomAccessIterator last,unsigned threads=0);
+#endif
 	/// Fast concatenate two sequences (that sequence to the right).
 	/** Concatenate two sequences (that sequence to the right), put result
 	 * into this sequence and leave that sequence empty.
@@ -890,9 +2186,10 @@ public:
 	 * Example: if sequence A contains {0,1,2} and sequeance B contains
 	 * {3,4,5}, after a call 'A.concatenate_right(B)' A contains
 	 * {0,1,2,3,4,5} and B is empty.
+	 * The allocators of both containers must be equal.
 	 * Complexity: O(log(N+M))
 	 * @param that container to concatenate	 */
-	void concatenate_right(btree_seq<T,L,M,A> &that);
+	void concatenate_right(btree_seq<T,L,M,A,P> &that);
 	/// Fast concatenate two sequences (that sequence to the left).
 	/** Concatenate two sequences (that sequence to the left), put result
 	 * into this sequence and leave that sequence empty.
@@ -900,38 +2197,91 @@ public:
 	 * Example: if sequence A contains {0,1,2} and sequeance B contains
 	 * {3,4,5}, after a call 'A.concatenate_left(B)' A contains
 	 * {3,4,5,0,1,2} and B is empty.
+	 * The allocators of both containers must be equal.
 	 * Complexity: O(log(N+M))
 	 * @param that container to concatenate	 */
-	void concatenate_left(btree_seq<T,L,M,A> &that);
+	void concatenate_left(btree_seq<T,L,M,A,P> &that);
 	///Fast split, leaving right piece in that container.
 	/** Split sequence into two parts: [0,pos) is left in this container,
 	 * [pos,size) is moved to that container. That container is cleaned before
 	 * operation. Example if A contained {0,1,2,3,4}, after A.split_right(B,3)
 	 * A contains {0,1,2} and B contains {3,4}. The operation is done without
 	 * moving all elements.
+	 * The allocators of both containers must be equal.
 	 * Complexity: O(log(N)), if the second container is initially empty.
 	 * @param that container for right part of split operation (old contents removed)
 	 * @param pos place to split */
-	void split_right(btree_seq<T,L,M,A> &that,size_type pos);
+	void split_right(btree_seq<T,L,M,A,P> &that,size_type pos);
 	///Fast split, leaving left piece in that container.
 	/** Split sequence into two parts: [pos,size) is left in this container,
 	 * [0,pos) is moved to that container. That container is cleaned before
 	 * operation. Example if A contained {0,1,2,3,4}, after A.split_left(B,3)
 	 * A contains {3,4} and B contains {0,1,2}. The operation is done without
 	 * moving all elements.
+	 * The allocators of both containers must be equal.
 	 * Complexity: O(log(N)), if the second container is initially empty.
 	 * @param that container for leftt part of split operation (old contents removed)
 	 * @param pos place to split */
-	void split_left(btree_seq<T,L,M,A> &that,size_type pos);
+	void split_left(btree_seq<T,L,M,A,P> &that,size_type pos);
+	///Read-only view with implicit index, see btree_seq::frozen_view.
+	class frozen_view;
+	///Moves the contents into a read-only view.
+	/** All elements are moved to view without copying, this container
+	 * becomes empty. Old contents of view are removed. The view indexes
+	 * the leaves of the tree, so its operator[] is faster than ours.
+	 * The nodes go to view as with swap(): if the allocator of view is not equal
+	 * to ours and does not propagate on swap, the elements are put into its nodes.
+	 * Complexity: O(N/M) and O(N/M) memory for the index, or O(N) if the elements
+	 * are put into the nodes of view.
+	 * @param view the view receiving the elements */
+	void freeze(frozen_view &view);
+	///Moves the contents of a read-only view back into this container.
+	/** Old contents of this container are removed, view becomes empty.
+	 * The nodes come back as with swap(), see freeze.
+	 * Complexity: constant, if this container is initially empty
+	 * and the allocators are equal or propagate on swap.
+	 * @param view the view giving the elements */
+	void thaw(frozen_view &view);
 
 	#if __cplusplus >= 201103L
+	///Immutable version of a container, see snapshot(). (C++11)
+	class snapshot_view;
+	///Makes the current contents the version returned by snapshot(). (C++11)
+	/** Only with P::copy_on_write==2. The version shares the nodes with
+	 * the container, so the next modification of a node copies it.
+	 * The previous version is released, its nodes are destroyed, when
+	 * no snapshot refers to them. The published version goes with the nodes
+	 * when they move to another container (swap, move, freeze and thaw).
+	 * Complexity: constant (and the release of old nodes). */
+	void publish();
+	///Returns the last published version. (C++11)
+	/** Only with P::copy_on_write==2. Unlike other functions, it may be called by
+	 * any thread, while the container is being modified by one writer thread.
+	 * The snapshot does not change afterwards and can be read by several threads.
+	 * Returns an empty snapshot, if nothing is published.
+	 * Complexity: constant. */
+	snapshot_view snapshot()const;
+
 	///Move operator= (C++11)
-	/** Creates a copy and leaves that container in empty state.
-	 * @param that container to copy  */
-	btree_seq &operator=(btree_seq<T,L,M,A> &&that)
+	/** Takes the contents of that and leaves that container in empty state.
+	 * The nodes are taken, if the allocator propagates on move assignment
+	 * (then it is taken too) or the allocators are equal. Otherwise the elements
+	 * are moved one by one into the nodes of this container.
+	 * Complexity: O(N), N=this->size(), plus O(that.size()) if the allocators differ.
+	 * @param that container to move from  */
+	btree_seq &operator=(btree_seq<T,L,M,A,P> &&that)
 	{
-		clear();
-		swap(that);
+		typedef ___alexkupri_helpers::my_alloc_traits<A> traits;
+		if(this!=&that){
+			clear();
+			if(traits::propagate_on_move||T_alloc==that.T_alloc){
+				swap_trees(that,___alexkupri_helpers::my_bool<traits::propagate_on_move!=0>());
+				swap_published(that.published);
+			}else{
+				assign(std::make_move_iterator(that.begin()),std::make_move_iterator(that.end()));
+				that.clear();
+			}
+		}
 		return *this;
 	}
 
@@ -976,51 +2326,213 @@ public:
 	size_type __branch_size(){return sizeof(Branch);}
 	/// Returns size of leaf node of the tree (profile, RTTI).
 	size_type __leaf_size(){return sizeof(Leaf);}
-	/// Function does nothing (compatibility with std::vector).
-	void reserve(size_type n){/*NOTHING*/}
-	/// Function does nothing (compatibility with std::vector).
-	void shrink_to_fit(){/*NOTHING*/}
+	/// Preallocates the nodes for growing up to n elements.
+	/** The leaves and branches, which inserting n-size() elements needs in the worst
+	 * case (half-filled nodes, the bound is derived in the implementation), are
+	 * allocated into a free pool of the container.
+	 * The nodes are taken from the pool while it is not empty, and the freed nodes
+	 * return to it up to the reserved number. The pool is dropped by shrink_to_fit,
+	 * parallel_assign and the destructor.
+	 * Complexity: O((n-N)/M). */
+	void reserve(size_type n);
+	/// Repacks the elements into as few leaves and branches as possible.
+	/** The elements are moved into full leaves (shared evenly, as by assign), the tree
+	 * gets the smallest depth, and the spare nodes of reserve are freed.
+	 * Each emptied old leaf is used again for a new one, so only the leaves by which
+	 * the new ones get ahead (one if the old leaves are full) and the new branches
+	 * are allocated in addition; the old branches are freed at the end.
+	 * With P::copy_on_write, the nodes shared with other containers are copied first.
+	 * Complexity: O(N). */
+	void shrink_to_fit();
+	/// Relocates the nodes in memory order, filling the leaves up to leaf_fill elements.
+	/** This is shrink_to_fit, but all the new nodes are allocated first and taken
+	 * in the order of addresses, so a sequential scan goes forward through memory.
+	 * A smaller leaf_fill (down to M/2) leaves room for inserts without splits.
+	 * The old nodes are freed at the end, so memory for both is needed.
+	 * Complexity: O(N). */
+	void compact(size_type leaf_fill=M);
+	/// Compacts the part of the sequence from pos, about max_leaves leaves at a time.
+	/** The leaves of each lowest branch are repacked into new ones, sorted by address
+	 * and filled up to leaf_fill; thin branches are merged as by erase. Returns the
+	 * position to continue from, or size() when the end is reached. Called in a loop
+	 * with a node or time budget, it spreads the work of compact between other
+	 * operations, though only the leaves are relocated.
+	 * Complexity: O(max_leaves*M+log(N)). */
+	size_type compact(size_type pos,size_type max_leaves,size_type leaf_fill=M);
 	/// Returns allocator.
 	allocator_type get_allocator()const{return T_alloc;}
 	///@}
 };
 
+/// Read-only view of a sequence with an implicit index of its leaves.
+/** The view is filled by btree_seq::freeze and emptied by btree_seq::thaw,
+ * both move the elements without copying them. The leaves stay where they are;
+ * the view keeps the boundaries of the leaves in one array in Eytzinger
+ * (breadth-first) order. operator[] is a branch-free binary search in this
+ * array followed by one leaf access, no parent/children pointers are followed,
+ * and the next probes of the search are close to each other in memory.
+ * Iterators are those of the frozen sequence. */
+template <typename T,int L,int M,typename A,typename P>
+class btree_seq<T,L,M,A,P>::frozen_view
+{
+	friend class btree_seq<T,L,M,A,P>;
+public:
+	///Value type, T.
+	typedef typename btree_seq::value_type value_type;
+	///Constant reference type, const T&.
+	typedef typename btree_seq::const_reference const_reference;
+	///Unsigned integer type.
+	typedef typename btree_seq::size_type size_type;
+	///Constant random-access iterator.
+	typedef typename btree_seq::const_iterator const_iterator;
+private:
+	struct Entry
+	{
+		Leaf *leaf;
+		size_type first;
+	};
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::template rebind<size_type>::other Ends_alloc_type;
+	typedef typename ___alexkupri_helpers::my_alloc_traits<A>::template rebind<Entry>::other Entries_alloc_type;
+	btree_seq tree;
+	//ends[k], entries[k], k=1..leaves: number of elements up to the end of
+	//the leaf and the leaf with its first position, in Eytzinger order.
+	size_type leaves;
+	size_type *ends;
+	Entry *entries;
+	void build_index();
+	void release_index();
+	void index_leaves(Node *n,size_type dep,size_type &k,size_type &sum);
+	frozen_view(const frozen_view &);
+	frozen_view &operator=(const frozen_view &);
+public:
+	///Empty view.
+	explicit frozen_view(const allocator_type &alloc=allocator_type())
+		:tree(alloc),leaves(0),ends(0),entries(0){}
+	///Destructor, deletes the elements.
+	~frozen_view(){release_index();}
+	///Constant access to element
+	/** No range check is done.
+	 * Complexity: O(log(N/M)).
+	 * @param pos index of the element*/
+	const_reference operator [](size_type pos)const
+	{
+		size_type k=1;
+		while(k<=leaves){
+			k=2*k+(ends[k]<=pos);
+		}
+		//the last step to the left led to the leaf
+		while(k&1){
+			k>>=1;
+		}
+		k>>=1;
+		const T *ptr=entries[k].leaf->elements;
+		return *(ptr+(pos-entries[k].first));
+	}
+	///Constant access to element with range check
+	/** Complexity: O(log(N/M)).
+	 * @param pos index of the element*/
+	const_reference at(size_type pos)const;
+	///Number of elements.
+	size_type size()const{return tree.size();}
+	///Returns true if the view contains no elements.
+	bool empty()const{return tree.empty();}
+	///Return constant iterator to beginning.
+	const_iterator begin()const{return tree.begin();}
+	///Return constant iterator to end.
+	const_iterator end()const{return tree.end();}
+};
+
+#if __cplusplus >= 201103L
+///Immutable version of btree_seq for concurrent readers. (C++11)
+/** Made by btree_seq::snapshot(). It shares the nodes with its container and
+ * other snapshots, so copying a snapshot takes constant time. Several threads
+ * may read one snapshot at the same time, each with its own iterators and hints.
+ * Old nodes are destroyed by the last snapshot referring to them. */
+template <typename T,int L,int M,typename A,typename P>
+class btree_seq<T,L,M,A,P>::snapshot_view
+{
+	friend class btree_seq<T,L,M,A,P>;
+public:
+	///Value type, T.
+	typedef typename btree_seq::value_type value_type;
+	///Constant reference type, const T&.
+	typedef typename btree_seq::const_reference const_reference;
+	///Unsigned integer type.
+	typedef typename btree_seq::size_type size_type;
+	///Constant random-access iterator.
+	typedef typename btree_seq::const_iterator const_iterator;
+	///Remembered path for finger search.
+	typedef typename btree_seq::hint hint;
+private:
+	btree_seq tree;
+public:
+	///Empty snapshot.
+	explicit snapshot_view(const allocator_type &alloc=allocator_type())
+		:tree(alloc){}
+	///Constant access to element
+	/** No range check is done.
+	 * Complexity: O(log(N)).
+	 * @param pos index of the element*/
+	const_reference operator [](size_type pos)const
+	{
+		Leaf *l;
+		size_type found=tree.find_leaf(l,pos);
+		const T *ptr=l->elements;
+		return *(ptr+found);
+	}
+	///Constant access to element with range check
+	/** Complexity: O(log(N)).
+	 * @param pos index of the element*/
+	const_reference at(size_type pos)const;
+	///Constant access to element using a hint, see btree_seq::get.
+	const_reference get(size_type pos,hint &h)const{return tree.get(pos,h);}
+	///Number of elements.
+	size_type size()const{return tree.size();}
+	///Returns true if the snapshot contains no elements.
+	bool empty()const{return tree.empty();}
+	///Return constant iterator to beginning.
+	const_iterator begin()const{return tree.begin();}
+	///Return constant iterator to end.
+	const_iterator end()const{return tree.end();}
+};
+#endif
+
 /// Swap contents of two containers.
-template <typename T,int L,int M,typename A>
-void swap(btree_seq<T,L,M,A> &first,btree_seq<T,L,M,A> &second)
+template <typename T,int L,int M,typename A,typename P>
+void swap(btree_seq<T,L,M,A,P> &first,btree_seq<T,L,M,A,P> &second)
 {
 	first.swap(second);
 }
 
 /// Lexicographical comparison
-template <typename T,int L,int M,typename A>
-bool   operator<(const btree_seq<T,L,M,A> &x,const btree_seq<T,L,M,A> &y)
+template <typename T,int L,int M,typename A,typename P>
+bool   operator<(const btree_seq<T,L,M,A,P> &x,const btree_seq<T,L,M,A,P> &y)
     { return std::lexicographical_compare(x.begin(), x.end(), y.begin(), y.end()); }
 
 /// Lexicographical comparison
-template <typename T,int L,int M,typename A>
-bool   operator>(const btree_seq<T,L,M,A> &x,const btree_seq<T,L,M,A> &y)
+template <typename T,int L,int M,typename A,typename P>
+bool   operator>(const btree_seq<T,L,M,A,P> &x,const btree_seq<T,L,M,A,P> &y)
     { return (y<x); }
 
 /// Lexicographical comparison
-template <typename T,int L,int M,typename A>
-bool   operator<=(const btree_seq<T,L,M,A> &x,const btree_seq<T,L,M,A> &y)
+template <typename T,int L,int M,typename A,typename P>
+bool   operator<=(const btree_seq<T,L,M,A,P> &x,const btree_seq<T,L,M,A,P> &y)
     { return !(y<x); }
 
 /// Lexicographical comparison
-template <typename T,int L,int M,typename A>
-bool   operator>=(const btree_seq<T,L,M,A> &x,const btree_seq<T,L,M,A> &y)
+template <typename T,int L,int M,typename A,typename P>
+bool   operator>=(const btree_seq<T,L,M,A,P> &x,const btree_seq<T,L,M,A,P> &y)
     { return !(x<y); }
 
 /// Equality of size and all elements
-template <typename T,int L,int M,typename A>
-bool  operator==(const btree_seq<T,L,M,A> &x,const btree_seq<T,L,M,A> &y)
+template <typename T,int L,int M,typename A,typename P>
+bool  operator==(const btree_seq<T,L,M,A,P> &x,const btree_seq<T,L,M,A,P> &y)
     { return (x.size() == y.size()
 	      && std::equal(x.begin(), x.end(), y.begin())); }
 
 /// Inequality of size or any elements
-template <typename T,int L,int M,typename A>
-bool  operator!=(const btree_seq<T,L,M,A> &x,const btree_seq<T,L,M,A> &y)
+template <typename T,int L,int M,typename A,typename P>
+bool  operator!=(const btree_seq<T,L,M,A,P> &x,const btree_seq<T,L,M,A,P> &y)
     { return !(x==y); }
 
 
@@ -14,25 +14,25 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 /// Moving elements while incrementing pointers
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::move_elements_inc(pointer dst,pointer src,size_type num)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::move_elements_inc(pointer dst,pointer src,size_type num)
 {
 	pointer limit=src+num;
 	while(src!=limit){
 #if __cplusplus >= 201103L
-		T_alloc.construct(dst,std::move(*src));
+		alloc_traits::construct(T_alloc,dst,std::move(*src));
 #else
-		T_alloc.construct(dst,*src);
+		alloc_traits::construct(T_alloc,dst,*src);
 #endif
-		T_alloc.destroy(src);
+		alloc_traits::destroy(T_alloc,src);
 		++dst;
 		++src;
 	}
 }
 
 /// Moving elements while decrementing pointers
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::move_elements_dec(pointer dst,pointer limit,size_type num)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::move_elements_dec(pointer dst,pointer limit,size_type num)
 {
 	pointer src=limit+num;
 	dst+=num;
@@ -40,32 +40,32 @@ void btree_seq<T,L,M,A>::move_elements_dec(pointer dst,pointer limit,size_type n
 		--dst;
 		--src;
 #if __cplusplus >= 201103L
-		T_alloc.construct(dst,std::move(*src));
+		alloc_traits::construct(T_alloc,dst,std::move(*src));
 #else
-		T_alloc.construct(dst,*src);
+		alloc_traits::construct(T_alloc,dst,*src);
 #endif
-		T_alloc.destroy(src);
+		alloc_traits::destroy(T_alloc,src);
 	}
 }
 
 ///Filling leaf with elements, elements are read from general-type iterator
-template <typename T,int L,int M,typename A>
+template <typename T,int L,int M,typename A,typename P>
 template <class InputIterator>
-typename btree_seq<T,L,M,A>::diff_type btree_seq<T,L,M,A>::
+typename btree_seq<T,L,M,A,P>::diff_type btree_seq<T,L,M,A,P>::
 	fill_elements(pointer dst,diff_type num,InputIterator &first,InputIterator last,
 	std::input_iterator_tag)
 {
 	pointer ptr=dst,limit=ptr+num;
 	try{
 		while((ptr!=limit)&&(first!=last)){
-			T_alloc.construct(ptr,*first);
+			alloc_traits::construct(T_alloc,ptr,*first);
 			++first;
 			++ptr;
 		}
 	}catch(...){
 		T *del_elems=dst;
 		while(del_elems!=ptr){
-			T_alloc.destroy(del_elems);
+			alloc_traits::destroy(T_alloc,del_elems);
 			del_elems++;
 		}
 		throw;
@@ -74,9 +74,9 @@ typename btree_seq<T,L,M,A>::diff_type btree_seq<T,L,M,A>::
 }
 
 ///Filling leaf with elements, elements are read from random access iterator
-template <typename T,int L,int M,typename A>
+template <typename T,int L,int M,typename A,typename P>
 template <class InputIterator>
-typename btree_seq<T,L,M,A>::diff_type btree_seq<T,L,M,A>::
+typename btree_seq<T,L,M,A,P>::diff_type btree_seq<T,L,M,A,P>::
 	fill_elements(pointer dst,diff_type num,InputIterator &first,InputIterator last,
 	std::random_access_iterator_tag)
 {
@@ -87,14 +87,14 @@ typename btree_seq<T,L,M,A>::diff_type btree_seq<T,L,M,A>::
 	pointer ptr=dst,limit=ptr+num;
 	try{
 		while(ptr!=limit){
-			T_alloc.construct(ptr,*first);
+			alloc_traits::construct(T_alloc,ptr,*first);
 			++first;
 			++ptr;
 		}
 	}catch(...){
 		T *del_elems=dst;
 		while(del_elems!=ptr){
-			T_alloc.destroy(del_elems);
+			alloc_traits::destroy(T_alloc,del_elems);
 			del_elems++;
 		}
 		throw;
@@ -103,130 +103,200 @@ typename btree_seq<T,L,M,A>::diff_type btree_seq<T,L,M,A>::
 }
 
 ///Destroying elements from leaf
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::burn_elements(pointer ptr,size_type num)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::burn_elements(pointer ptr,size_type num)
 {
+	if(___alexkupri_helpers::my_trivial_destroy<T,A>::value){
+		return;
+	}
 	while(num){
-		T_alloc.destroy(ptr);
+		alloc_traits::destroy(T_alloc,ptr);
 		ptr++;
 		num--;
 	}
 }
 
+///Changing the number of elements in one child.
+///With prefix sums, all the sums from idx on are changed.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::add_to_child(Branch *b,size_type idx,diff_type diff)
+{
+	if(P::prefix_counts){
+		counter_type *nums=b->nums;
+		size_type limit=b->fillament;
+		for(size_type j=idx;j<limit;j++){
+			nums[j]+=diff;
+		}
+	}else{
+		b->nums[idx]+=diff;
+	}
+}
+
+///Moving the boundary between children left and left+1, so that
+///diff elements are passed from the right child to the left one.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::shift_count(Branch *b,size_type left,diff_type diff)
+{
+	b->nums[left]+=diff;
+	if(!P::prefix_counts){
+		b->nums[left+1]-=diff;
+	}
+}
+
+///Finding the child containing pos; pos becomes relative to that child.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::find_in_branch
+	(const Branch *b,size_type &pos)
+{
+	size_type k=0,val;
+	if(P::prefix_counts){
+		k=___alexkupri_helpers::my_prefix_search<sizeof(counter_type)>::
+			find(b->nums,b->fillament,static_cast<counter_type>(pos));
+		if(k!=0){
+			pos-=b->nums[k-1];
+		}
+	}else{
+		val=b->nums[0];
+		while(pos>=val){
+			pos-=val;
+			k++;
+			val=b->nums[k];
+		}
+	}
+	return k;
+}
+
 ///Preparing place for inserting children by moving some children.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::insert_children(Branch *b,size_type idx,size_type num)
+///New places hold empty children until they are filled.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::insert_children(Branch *b,size_type idx,size_type num)
 {
-	size_type j=b->fillament;
+	size_type j=b->fillament,base=(P::prefix_counts&&idx)?b->nums[idx-1]:0;
 	while(j!=idx){
 		j--;
 		b->children[j+num]=b->children[j];
+		b->children[j+num]->place=j+num;
 		b->nums[j+num]=b->nums[j];
 	};
+	for(j=idx;j<idx+num;j++){
+		b->nums[j]=base;
+	}
 	b->fillament+=num;
 }
 
-///Delete some free places by moving some children.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::delete_children(Branch *b,size_type idx,size_type num)
+///Delete some children by moving the rest of children.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::delete_children(Branch *b,size_type idx,size_type num)
 {
 	Node **children=b->children;
-	size_type *nums=b->nums;
+	counter_type *nums=b->nums;
+	counter_type removed=0;
+	if(P::prefix_counts){
+		removed=nums[idx+num-1]-(idx?nums[idx-1]:0);
+	}
 	for(size_type j=idx;j<b->fillament-num;j++){
 		children[j]=children[j+num];
-		nums[j]=nums[j+num];
+		children[j]->place=j;
+		nums[j]=nums[j+num]-removed;
 	}
 	b->fillament-=num;
 }
 
 ///Moving some children from old parent (src) to new parent (dst),
 ///returning total amount elements in them.
-template <typename T,int L,int M,typename A>
-typename btree_seq<T,L,M,A>::size_type btree_seq<T,L,M,A>::move_children(
+///Places [idst,idst+num) in dst must be free (see insert_children).
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::move_children(
 	Branch *dst,size_type idst,Branch *src,size_type isrc,size_type num)
 {
-	size_type j,res=0,cur;
+	size_type j,res=0,cur,base=(P::prefix_counts&&idst)?dst->nums[idst-1]:0;
 	Node *n;
 	for(j=0;j<num;j++){
 		n=src->children[isrc+j];
 		dst->children[idst+j]=n;
 		n->parent=dst;
-		cur=src->nums[isrc+j];
-		dst->nums[idst+j]=cur;
+		n->place=idst+j;
+		cur=child_num(src,isrc+j);
 		res+=cur;
+		dst->nums[idst+j]=P::prefix_counts?base+res:cur;
+	}
+	if(P::prefix_counts){
+		add_to_child(dst,idst+num,res);
 	}
 	return res;
 }
 
-/// Inserting leaves into branch, returning total number of elements in leaves
-template <typename T,int L,int M,typename A>
-typename btree_seq<T,L,M,A>::size_type
-	btree_seq<T,L,M,A>::fill_leaves(Branch *b,size_type place,Leaf **l,size_type num)
+/// Inserting leaves into free places of branch, returning total number of elements in leaves
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type
+	btree_seq<T,L,M,A,P>::fill_leaves(Branch *b,size_type place,Leaf **l,size_type num)
 {
-	size_type j,res=0;
+	size_type j,res=0,base=(P::prefix_counts&&place)?b->nums[place-1]:0;
 	for(j=0;j<num;j++){
 		b->children[j+place]=l[j];
-		b->nums[j+place]=l[j]->fillament;
 		res+=l[j]->fillament;
+		b->nums[j+place]=P::prefix_counts?base+res:l[j]->fillament;
 		l[j]->parent=b;
+		l[j]->place=j+place;
+	}
+	if(P::prefix_counts){
+		add_to_child(b,place+num,res);
 	}
 	return res;
 }
 
 ///Trying to merge leaves (parent of the leaves and index of the left leaf are given).
-template <typename T,int L,int M,typename A>
-bool btree_seq<T,L,M,A>::try_merge_leaves(Branch *b,size_type idx)
+template <typename T,int L,int M,typename A,typename P>
+bool btree_seq<T,L,M,A,P>::try_merge_leaves(Branch *b,size_type idx)
 {
-	size_type l=b->nums[idx],r=b->nums[idx+1];
+	size_type l=child_num(b,idx),r=child_num(b,idx+1);
 	if(l+r>M){
 		return false;
 	}
-	Leaf *left=static_cast<Leaf*>(b->children[idx]),
-			*right=static_cast<Leaf*>(b->children[idx+1]);
+	Leaf *left=static_cast<Leaf*>(own_child(b,idx,0)),
+			*right=static_cast<Leaf*>(own_child(b,idx+1,0));
 	move_elements_inc(left->elements+l,right->elements,r);
 	left->fillament=l+r;
-	b->nums[idx]=l+r;
+	shift_count(b,idx,r);
 	delete_leaf(right);
 	return true;
 }
 
 ///Balancing leaves by copying some elements from left to right
 ///(parent of leaves and index of the left leaf are given).
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::balance_leaves_lr(Branch *b,size_type idx)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::balance_leaves_lr(Branch *b,size_type idx)
 {
-	Leaf *left=static_cast<Leaf*>(b->children[idx]),
-		  *right=static_cast<Leaf*>(b->children[idx+1]);
-	size_type l=b->nums[idx],r=b->nums[idx+1];
+	Leaf *left=static_cast<Leaf*>(own_child(b,idx,0)),
+		  *right=static_cast<Leaf*>(own_child(b,idx+1,0));
+	size_type l=child_num(b,idx),r=child_num(b,idx+1);
 	size_type moves=l-(r+l)/2;
 	move_elements_dec(right->elements+moves,right->elements,r);
 	move_elements_inc(right->elements,left->elements+l-moves,moves);
 	left->fillament-=moves;
 	right->fillament+=moves;
-	b->nums[idx]-=moves;
-	b->nums[idx+1]+=moves;
+	shift_count(b,idx,-static_cast<diff_type>(moves));
 }
 
 ///Balancing leaves by copying some elements from right to left
 ///(parent of leaves and index of the left leaf are given).
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::balance_leaves_rl(Branch *b,size_type idx)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::balance_leaves_rl(Branch *b,size_type idx)
 {
-	Leaf *left=static_cast<Leaf*>(b->children[idx]),
-			*right=static_cast<Leaf*>(b->children[idx+1]);
-	size_type l=b->nums[idx],r=b->nums[idx+1];
+	Leaf *left=static_cast<Leaf*>(own_child(b,idx,0)),
+			*right=static_cast<Leaf*>(own_child(b,idx+1,0));
+	size_type l=child_num(b,idx),r=child_num(b,idx+1);
 	size_type moves=r-(r+l)/2;
 	move_elements_inc(left->elements+l,right->elements,moves);
 	move_elements_inc(right->elements,right->elements+moves,r-moves);
 	left->fillament+=moves;
 	right->fillament-=moves;
-	b->nums[idx]+=moves;
-	b->nums[idx+1]-=moves;
+	shift_count(b,idx,moves);
 }
 
 ///Deleting the empty leaf.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::delete_leaf(Leaf *l)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::delete_leaf(Leaf *l)
 {
 	Branch *parent=l->parent;
 	size_type idx;
@@ -239,8 +309,8 @@ void btree_seq<T,L,M,A>::delete_leaf(Leaf *l)
 }
 
 ///Check for underflow of leaf (i.e. if it can be deleted, merged or balanced if too thin).
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::underflow_leaf(Leaf *l)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::underflow_leaf(Leaf *l)
 {
 	if(l->fillament<M/2){
 		Branch *parent=l->parent;
@@ -272,18 +342,19 @@ void btree_seq<T,L,M,A>::underflow_leaf(Leaf *l)
 }
 
 ///Trying to merge two branches into one (parent of branches and index of the left branch are given).
-template <typename T,int L,int M,typename A>
-bool btree_seq<T,L,M,A>::try_merge_branches(Branch *b,size_type idx)
+template <typename T,int L,int M,typename A,typename P>
+bool btree_seq<T,L,M,A,P>::try_merge_branches(Branch *b,size_type idx)
 {
-	Branch *left=static_cast<Branch*>(b->children[idx]),
-		   *right=static_cast<Branch*>(b->children[idx+1]);
-	size_type l=left->fillament,r=right->fillament;
+	size_type l=static_cast<Branch*>(b->children[idx])->fillament,
+		r=static_cast<Branch*>(b->children[idx+1])->fillament;
 	if(l+r>L){
 		return false;
 	}
+	Branch *left=static_cast<Branch*>(own_child(b,idx,1)),
+		   *right=static_cast<Branch*>(own_child(b,idx+1,1));
 	move_children(left,left->fillament,right,0,right->fillament);
 	left->fillament+=right->fillament;
-	b->nums[idx]+=b->nums[idx+1];
+	shift_count(b,idx,child_num(b,idx+1));
 	branch_alloc.deallocate(right,1);
 	delete_children(b,idx+1,1);
 	return true;
@@ -291,39 +362,37 @@ bool btree_seq<T,L,M,A>::try_merge_branches(Branch *b,size_type idx)
 
 ///Balancing branches by moving some nodes from left to right
 ///(parent of branches and index of the left branch are given).
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::balance_branch_lr(Branch *b,size_type idx)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::balance_branch_lr(Branch *b,size_type idx)
 {
-	Branch *left=static_cast<Branch*>(b->children[idx]),
-		*right=static_cast<Branch*>(b->children[idx+1]);
+	Branch *left=static_cast<Branch*>(own_child(b,idx,1)),
+		*right=static_cast<Branch*>(own_child(b,idx+1,1));
 	size_type l=left->fillament,r=right->fillament,
 		moves=l-(l+r)/2;
 	insert_children(right,0,moves);
 	size_type num=move_children(right,0,left,l-moves,moves);
 	left->fillament-=moves;
-	b->nums[idx]-=num;
-	b->nums[idx+1]+=num;
+	shift_count(b,idx,-static_cast<diff_type>(num));
 }
 
 ///Balancing branches by moving some nodes from right to left
 ///(parent of branches and index of the left branch are given).
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::balance_branch_rl(Branch *b,size_type idx)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::balance_branch_rl(Branch *b,size_type idx)
 {
-	Branch *left=static_cast<Branch*>(b->children[idx]),
-		*right=static_cast<Branch*>(b->children[idx+1]);
+	Branch *left=static_cast<Branch*>(own_child(b,idx,1)),
+		*right=static_cast<Branch*>(own_child(b,idx+1,1));
 	size_type l=left->fillament,r=right->fillament,
 		moves=r-(l+r)/2;
 	size_type num=move_children(left,l,right,0,moves);
 	delete_children(right,0,moves);
 	left->fillament+=moves;
-	b->nums[idx]+=num;
-	b->nums[idx+1]-=num;
+	shift_count(b,idx,num);
 }
 
 ///Deleting branch and underflow ancestors if necessary.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::underflow_branch(Branch *node)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::underflow_branch(Branch *node)
 {
 	Branch *parent=node;
 	size_type idx;
@@ -335,6 +404,7 @@ void btree_seq<T,L,M,A>::underflow_branch(Branch *node)
 			if(node->fillament==1){//if root has only one child then level down
 				root=node->children[0];
 				root->parent=0;
+				root->place=0;
 				depth--;
 				branch_alloc.deallocate(node,1);
 			}
@@ -364,93 +434,136 @@ void btree_seq<T,L,M,A>::underflow_branch(Branch *node)
 }
 
 ///Find leaf and position of element in leaf, having position of the element.
-template <typename T,int L,int M,typename A>
-typename btree_seq<T,L,M,A>::size_type btree_seq<T,L,M,A>
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>
 	::find_leaf(Leaf *&l,size_type pos)const
 {
 	Node *node=root;
 	Branch *br;
-	size_type j=depth,k,val;
+	size_type j=depth,k;
 	while(j){
-		k=0;
 		br=static_cast<Branch*>(node);
-		val=br->nums[0];
-		while(pos>=val){
-			pos-=val;
-			k++;
-			val=br->nums[k];
-		}
+		k=find_in_branch(br,pos);
 		node=br->children[k];
 		j--;
+		if(j){
+			prefetch_branch(node);
+		}
 	}
 	l=static_cast<Leaf*>(node);
 	return pos;
 }
 
+///Find leaf and position of element in leaf, starting from the deepest node
+///remembered by the hint, which contains pos. The hint remembers the new path.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>
+	::find_leaf(Leaf *&l,size_type pos,hint &h)const
+{
+	Node *node=root;
+	Branch *br;
+	size_type j=depth,k,d,base=0,rel;
+	if((h.tree==this)&&(h.version==version)){
+		for(d=0;d<h.levels;d++){
+			if((h.first[d]<=pos)&&(pos<h.last[d])){
+				node=h.nodes[d];
+				j=d;
+				base=h.first[d];
+				break;
+			}
+		}
+	}else{
+		h.tree=this;
+		h.version=version;
+		h.levels=(depth<hint::max_levels)?depth+1:hint::max_levels;
+		if(depth<hint::max_levels){
+			h.nodes[depth]=root;
+			h.first[depth]=0;
+			h.last[depth]=count;
+		}
+	}
+	rel=pos-base;
+	while(j){
+		br=static_cast<Branch*>(node);
+		d=rel;
+		k=find_in_branch(br,rel);
+		node=br->children[k];
+		base+=d-rel;
+		j--;
+		if(j<hint::max_levels){
+			h.nodes[j]=node;
+			h.first[j]=base;
+			h.last[j]=base+child_num(br,k);
+		}
+		if(j){
+			prefetch_branch(node);
+		}
+	}
+	l=static_cast<Leaf*>(node);
+	return rel;
+}
+
 ///Find leaf and position of element in leaf, the position is given,
 /// and increment counters by the way (we are going to add or remove
 ///some elements at this position).
 ///We can stop at depth_lim, not to go to the leaf, if we a going to
 ///insert/remove the whole subtree.
-template <typename T,int L,int M,typename A>
-typename btree_seq<T,L,M,A>::size_type
-	btree_seq<T,L,M,A>::find_leaf(Node *&l,size_type pos,difference_type increment,size_type depth_lim)
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type
+	btree_seq<T,L,M,A,P>::find_leaf(Node *&l,size_type pos,difference_type increment,size_type depth_lim)
 {
 	Node *node=root;
 	Branch *br;
-	size_type j=depth-depth_lim,k,val;
+	size_type j=depth-depth_lim,k;
 	while(j){
-		k=0;
 		br=static_cast<Branch*>(node);
-		val=br->nums[0];
-		while(pos>=val){
-			pos-=val;
-			k++;
-			val=br->nums[k];
-		}
-		br->nums[k]=br->nums[k]+increment;
+		k=find_in_branch(br,pos);
 		node=br->children[k];
 		j--;
+		if(j){
+			prefetch_branch(node);
+		}
+		add_to_child(br,k,increment);
 	}
 	l=node;
 	count=count+increment;
 	return pos;
 }
 
-///Find child in a branch
-template <typename T,int L,int M,typename A>
-typename btree_seq<T,L,M,A>::size_type btree_seq<T,L,M,A>::find_child
+///Find child in a branch: every node keeps its index in the parent.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::find_child
 	(Branch *b,Node* child)
 {
-	for(size_type j=0;j<b->fillament;j++){
-		if(child==b->children[j]){
-			return j;
-		}
-	}
-	assert(false);
-	return 0;
+	assert((child->place<b->fillament)&&(b->children[child->place]==child));
+	(void)b;
+	return child->place;
 }
 
 ///Initialize the empty tree (preparing for insert).
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::init_tree()
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::init_tree()
 {
 	Leaf *l=leaf_alloc.allocate(1);
+	l->init_refs();
 	l->fillament=0;
 	l->parent=0;
+	l->place=0;
 	root=l;
 	depth=0;
 }
 
 ///Actions necessary to increase the depth of the tree by one.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::increase_depth(Branch *new_branch)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::increase_depth(Branch *new_branch)
 {
 	new_branch->fillament=1;
 	new_branch->children[0]=root;
 	new_branch->nums[0]=count;
 	new_branch->parent=0;
+	new_branch->place=0;
 	root->parent=new_branch;
+	root->place=0;
 	root=new_branch;
 	depth++;
 }
@@ -459,9 +572,9 @@ void btree_seq<T,L,M,A>::increase_depth(Branch *new_branch)
 ///We are going to split branches, so we count how many branches we need and reserve
 ///them in advance, building a list. This is done for not getting no_mem exception
 ///in the middle of splitting.
-template <typename T,int L,int M,typename A>
-typename btree_seq<T,L,M,A>::Branch *
-	btree_seq<T,L,M,A>::reserve_enough_branches_splitting(Node* existing)
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::Branch *
+	btree_seq<T,L,M,A,P>::reserve_enough_branches_splitting(Node* existing)
 {
 	Branch *parent,*new_branch;
 	Branch *branch_bundle=NULL;
@@ -470,6 +583,7 @@ typename btree_seq<T,L,M,A>::Branch *
 		for(;;){
 			if((parent==NULL)||(parent->fillament==L)){
 				new_branch=branch_alloc.allocate(1);
+				new_branch->init_refs();
 				new_branch->parent=branch_bundle;
 				branch_bundle=new_branch;
 			}
@@ -490,12 +604,13 @@ typename btree_seq<T,L,M,A>::Branch *
 }
 
 ///Allocate the node (branch or leaf) and branches enough for splitting.
-template <typename T,int L,int M,typename A>
+template <typename T,int L,int M,typename A,typename P>
 template <typename Alloc,typename Node_type>
-void btree_seq<T,L,M,A>::prepare_for_splitting(Branch *&branch_bundle,
+void btree_seq<T,L,M,A,P>::prepare_for_splitting(Branch *&branch_bundle,
 		Node_type *&result,Node_type *existing,Alloc &alloc)
 {
 	result=alloc.allocate(1);
+	result->init_refs();
 	try{
 		branch_bundle=reserve_enough_branches_splitting(existing);
 	}catch(...){
@@ -505,8 +620,8 @@ void btree_seq<T,L,M,A>::prepare_for_splitting(Branch *&branch_bundle,
 }
 
 ///Splitting node. Given are: node to split, node that appears to the right from it and number of elements in the right node.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::split(Node* existing,Node* right_to_existing,
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::split(Node* existing,Node* right_to_existing,
 		size_type right_count,Branch *branch_bundle)
 {
 	size_type k,num=0;
@@ -523,8 +638,8 @@ void btree_seq<T,L,M,A>::split(Node* existing,Node* right_to_existing,
 
 ///Adding child to the branch (while splitting its existing child),
 ///from left or right side (lr).
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::add_child(Branch* parent,Node* inserted,
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::add_child(Branch* parent,Node* inserted,
 		size_type elements,size_type pos,size_type rl,Branch *branch_bundle)
 {
 	Branch *new_branch=0, *branch_to_insert=parent;
@@ -532,20 +647,20 @@ void btree_seq<T,L,M,A>::add_child(Branch* parent,Node* inserted,
 	if(parent->fillament==L){//if we cannot fit into current branch, splitting
 		new_branch=branch_bundle;//we plan to execute new iteration
 		branch_bundle=branch_bundle->parent;
+		new_branch->fillament=L/2;
 		num=move_children(new_branch,0,parent,L-L/2,L/2);
 		parent->fillament=L-L/2;
-		new_branch->fillament=L/2;
 		if(pos>=L-L/2){
 			branch_to_insert=new_branch;
 			pos-=L-L/2;
 		}
 	}
-	//inserting
+	//inserting, elements are passed from the existing child to the inserted one
 	inserted->parent=branch_to_insert;
+	inserted->place=pos+rl;
 	insert_children(branch_to_insert,pos+rl,1);
 	branch_to_insert->children[pos+rl]=inserted;
-	branch_to_insert->nums[pos+rl]=elements;
-	branch_to_insert->nums[pos+1-rl]-=elements;
+	shift_count(branch_to_insert,pos,rl?-static_cast<diff_type>(elements):elements);
 	//performing next splitting, if necessary
 	if(new_branch!=0){
 		split(parent,new_branch,num,branch_bundle);
@@ -555,8 +670,8 @@ void btree_seq<T,L,M,A>::add_child(Branch* parent,Node* inserted,
 ///After some operations, like multiple delete or multiple insert,
 ///thin leaves and branches can occur at certain positions.
 ///We need to check and underfow.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::deep_sew(size_type pos)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::deep_sew(size_type pos)
 {
 	Node *n=root;
 	size_type dep=depth;
@@ -577,13 +692,9 @@ void btree_seq<T,L,M,A>::deep_sew(size_type pos)
 				cur=pos;
 				//start from the beginning
 			}else{
-				j=0;
 				//find child for next iteration
-				while(cur>=b->nums[j]){
-					cur-=b->nums[j];
-					j++;
-				}
-				n=b->children[j];
+				j=find_in_branch(b,cur);
+				n=own_child(b,j,dep-1);
 				dep--;
 				//underflow
 				if((b->parent!=0)&&(b->fillament<L/2)){
@@ -595,8 +706,8 @@ void btree_seq<T,L,M,A>::deep_sew(size_type pos)
 }
 
 ///
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::my_deep_sew(size_type pos)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::my_deep_sew(size_type pos)
 {
 	if(pos!=0){
 		deep_sew(pos-1);
@@ -608,8 +719,8 @@ void btree_seq<T,L,M,A>::my_deep_sew(size_type pos)
 
 ///Some special cases for quick sewing together.
 ///We are given leaf to the left of isertion and position.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::advanced_sew_together
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::advanced_sew_together
 	(Leaf *last_leaf,size_type pos)
 {
 	Branch *parent=last_leaf->parent;
@@ -624,7 +735,7 @@ void btree_seq<T,L,M,A>::advanced_sew_together
 			}else if(last_leaf->fillament<M/2){//left leaf is small
 				underflow_leaf(last_leaf);
 			}else{//right or no leaf is small
-				underflow_leaf(static_cast<Leaf*>(parent->children[j+1]));
+				underflow_leaf(static_cast<Leaf*>(own_child(parent,j+1,0)));
 			}
 			return;
 		}
@@ -633,13 +744,16 @@ void btree_seq<T,L,M,A>::advanced_sew_together
 }
 
 ///Preparing place for inserting some (small) amount of elements.
-template <typename T,int L,int M,typename A>
-typename btree_seq<T,L,M,A>::size_type btree_seq<T,L,M,A>::prepare_leaf_for_inserting
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::prepare_leaf_for_inserting
 	(size_type pos,diff_type num,Leaf *&res,Leaf **sibling)
 {
 	Leaf *l,*l2=0;
 	Node *nod;
 	size_type found,delta=0,fillament,place_of_splitting=pos;
+	assert_length(num);
+	modified();
+	own_range(pos?pos-1:0,pos+1);
 	if(count==0){
 		init_tree();
 	}
@@ -685,8 +799,8 @@ typename btree_seq<T,L,M,A>::size_type btree_seq<T,L,M,A>::prepare_leaf_for_inse
 }
 
 ///Preparing place for inserting some (small) amount of elements.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::undo_preparing_to_insert
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::undo_preparing_to_insert
 	(size_type pos,diff_type num,Leaf *l,Leaf *sibling,size_type found)
 {
 	Node *dummy;
@@ -708,9 +822,9 @@ void btree_seq<T,L,M,A>::undo_preparing_to_insert
 ///Helper function for mass insert. It ensures, that all consequent inserting can be done
 ///by inserting the whole leafs. Firstly, it cuts leaf in the place of insertion if necessary.
 ///Secondly, it fills the left leaf with elements until it is full.
-template <typename T,int L,int M,typename A> template <class InputIterator>
-typename btree_seq<T,L,M,A>::Leaf
-	*btree_seq<T,L,M,A>::start_inserting
+template <typename T,int L,int M,typename A,typename P> template <class InputIterator>
+typename btree_seq<T,L,M,A,P>::Leaf
+	*btree_seq<T,L,M,A,P>::start_inserting
 	(size_type &pos,InputIterator &first,InputIterator last)
 {
 	diff_type n=0;
@@ -723,6 +837,7 @@ typename btree_seq<T,L,M,A>::Leaf
 	}else if(pos==0){
 		return 0;
 	}
+	own_range(pos-1,pos+1);
 	found=find_leaf(l,pos-1)+1;
 	if(found!=l->fillament){//we need to split existing leaf first
 		prepare_for_splitting(branch_bundle,new_leaf,l,leaf_alloc);
@@ -735,8 +850,10 @@ typename btree_seq<T,L,M,A>::Leaf
 	try{
 		n=fill_elements(l->elements+found,static_cast<diff_type>(M-found),first,last,
 			typename std::iterator_traits<InputIterator>::iterator_category());
+		assert_length(n);
 	}
 	catch(...){
+		burn_elements(l->elements+found,n);
 		underflow_leaf(l);//this is for case of empty tree
 		my_deep_sew(pos);//this is for case splitting
 		throw;
@@ -749,12 +866,14 @@ typename btree_seq<T,L,M,A>::Leaf
 
 ///Inserting multiple leaves (not more than L-1) at given position.
 ///Assuming that position is between leaves.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::insert_leaves(Leaf **l,size_type num_leaves,
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::insert_leaves(Leaf **l,size_type num_leaves,
 	diff_type num_elems,size_type pos)
 {
+	assert_length(num_elems);
 	if(depth==0){
 		Branch *new_branch=branch_alloc.allocate(1);
+		new_branch->init_refs();
 		increase_depth(new_branch);
 	}
 	Node *left_neighbour;
@@ -787,22 +906,22 @@ void btree_seq<T,L,M,A>::insert_leaves(Leaf **l,size_type num_leaves,
 		}
 		n+=num_leaves;
 		first=n/2;
-		fill_leaves(parent,0,nodes,first);
-		sum=fill_leaves(new_branch,0,nodes+first,n-first);
 		parent->fillament=first;
 		new_branch->fillament=n-first;
+		fill_leaves(parent,0,nodes,first);
+		sum=fill_leaves(new_branch,0,nodes+first,n-first);
 		split(parent,new_branch,sum,branch_bundle);
 	}else{
-		parent->nums[oldplace]=parent->nums[oldplace]-num_elems;
+		add_to_child(parent,oldplace,-num_elems);//new elements were counted in the neighbour
 		insert_children(parent,place,num_leaves);
 		fill_leaves(parent,place,l,num_leaves);
 	}
 }
 
 ///Helper function for multiple insert. Creates and inserts the whole leaves.
-template <typename T,int L,int M,typename A> template <class InputIterator>
-typename btree_seq<T,L,M,A>::Leaf
-	*btree_seq<T,L,M,A>::insert_whole_leaves
+template <typename T,int L,int M,typename A,typename P> template <class InputIterator>
+typename btree_seq<T,L,M,A,P>::Leaf
+	*btree_seq<T,L,M,A,P>::insert_whole_leaves
 		(size_type startpos,size_type &pos,InputIterator first,InputIterator last,Leaf *last_leaf)
 {
 	Leaf *l[L];
@@ -814,6 +933,7 @@ typename btree_seq<T,L,M,A>::Leaf
 			leaf_num=0;
 			while((first!=last)&&(leaf_num<L-1)){
 				last_leaf=leaf_alloc.allocate(1);
+				last_leaf->init_refs();
 				last_leaf->fillament=0;
 				l[leaf_num]=last_leaf;
 				leaf_num++;
@@ -841,8 +961,8 @@ typename btree_seq<T,L,M,A>::Leaf
 }
 
 //Implementation of the public insert function.
-template <typename T,int L,int M,typename A> template <class InputIterator>
-void btree_seq<T,L,M,A>::insert
+template <typename T,int L,int M,typename A,typename P> template <class InputIterator>
+void btree_seq<T,L,M,A,P>::insert
 	(size_type pos,InputIterator first,InputIterator last)
 {
 	size_type startpos=pos;
@@ -850,6 +970,7 @@ void btree_seq<T,L,M,A>::insert
 	if(first==last){
 		return;
 	}
+	modified();
 	n=count_difference(first,last,M/2+1,
 		typename std::iterator_traits<InputIterator>::iterator_category());
 	if(n<=M/2){
@@ -866,66 +987,564 @@ void btree_seq<T,L,M,A>::insert
 		if(sibling!=0){
 			underflow_leaf(sibling);
 		}
-	}else{
+	}else if(!insert_built_tree(pos,first,last,n,
+			typename std::iterator_traits<InputIterator>::iterator_category())){
 		Leaf *last_leaf=start_inserting(pos,first,last);
 		last_leaf=insert_whole_leaves(startpos,pos,first,last,last_leaf);
 		advanced_sew_together(last_leaf,pos);
 	}
 }
 
+//Implementation of the public insert_batch function.
+template <typename T,int L,int M,typename A,typename P> template <class PosIterator,class InputIterator>
+InputIterator btree_seq<T,L,M,A,P>::insert_batch(PosIterator first,PosIterator last,InputIterator values)
+{
+	if(first==last){
+		return values;
+	}
+	modified();
+	Leaf *staged=leaf_alloc.allocate(1),*l=0,*newleaf;
+	Branch *branch_bundle=0;
+	hint h;
+	size_type offsets[M];
+	size_type shift=0,g=0,pos,start,f,t,stay,a,i,run,hi;
+	try{
+		while(first!=last){
+			pos=*first+shift;
+			own_range(pos?pos-1:0,pos+1);
+			if(count==0){
+				init_tree();
+			}
+			if(pos!=0){
+				start=pos-1-find_leaf(l,pos-1,h);
+			}else{
+				start=find_leaf(l,0,h);
+			}
+			f=l->fillament;
+			//the values going into this leaf are staged first, up to a leaf of them
+			for(g=0;(g<M)&&(first!=last)&&(*first+shift<=start+f);++first){
+				offsets[g]=*first+shift-start;
+				alloc_traits::construct(T_alloc,staged->elements+g,*values);
+				++values;
+				++g;
+			}
+			assert_length(g);
+			t=f+g;
+			stay=t;
+			newleaf=0;
+			if(t>M){
+				prepare_for_splitting(branch_bundle,newleaf,l,leaf_alloc);
+				stay=t-t/2;
+			}
+			//nothing throws from here on
+			for(Node *c=l;c->parent!=0;c=c->parent){
+				add_to_child(c->parent,c->place,g);
+			}
+			count+=g;
+			if(newleaf!=0){
+				newleaf->fillament=t/2;
+				split(l,newleaf,t/2,branch_bundle);
+				modified();
+			}else{
+				//the path in the hint stays valid, its nodes just got g more elements
+				for(i=0;i<h.levels;i++){
+					h.last[i]+=g;
+				}
+			}
+			l->fillament=stay;
+			//merging the leaf and the staged values from the back, every element is moved once:
+			//the run of old elements behind the last staged value, then the value itself
+			for(a=f,i=t;(g!=0)||(a>stay);){
+				run=a-(g?offsets[g-1]:stay);
+				hi=(i>stay)?i-stay:0;
+				if(hi>run){
+					hi=run;
+				}
+				if(hi!=0){
+					move_elements_inc(newleaf->elements+(i-hi-stay),l->elements+(a-hi),hi);
+				}
+				move_elements_dec(l->elements+(i-run),l->elements+(a-run),run-hi);
+				a-=run;
+				i-=run;
+				if(g!=0){
+					--g;
+					--i;
+					move_elements_inc((i<stay)?l->elements+i:newleaf->elements+(i-stay),staged->elements+g,1);
+				}
+			}
+			shift+=t-f;
+		}
+	}catch(...){
+		burn_elements(staged->elements,g);
+		leaf_alloc.deallocate(staged,1);
+		if((count==0)&&(l!=0)){
+			underflow_leaf(l);//this is for case of empty tree
+		}
+		throw;
+	}
+	leaf_alloc.deallocate(staged,1);
+	return values;
+}
+
+///Helper function for mass insert of a range of known size: if the tree is empty,
+///the range is loaded into it, if the range goes to either end, it is loaded
+///into a new tree, which is concatenated. Returns false in other cases.
+template <typename T,int L,int M,typename A,typename P> template <class InputIterator>
+bool btree_seq<T,L,M,A,P>::insert_built_tree(size_type pos,InputIterator first,InputIterator last,
+	diff_type n,std::random_access_iterator_tag)
+{
+	if(count==0){
+		build_tree(first,last,n);
+		return true;
+	}
+	if((pos!=0)&&(pos!=count)){
+		return false;
+	}
+	btree_seq<T,L,M,A,P> that(T_alloc);
+	//the new tree takes its nodes from the spare ones of reserve, also when it
+	//takes this tree from the left (as concatenate_left does)
+	that.leaf_alloc.swap_spares(leaf_alloc);
+	that.branch_alloc.swap_spares(branch_alloc);
+	try{
+		that.build_tree(first,last,n);
+		if(pos==0){
+			that.concatenate_right(*this);
+		}
+	}catch(...){
+		that.leaf_alloc.swap_spares(leaf_alloc);
+		that.branch_alloc.swap_spares(branch_alloc);
+		throw;
+	}
+	that.leaf_alloc.swap_spares(leaf_alloc);
+	that.branch_alloc.swap_spares(branch_alloc);
+	if(pos==0){
+		swap_nodes(that);
+	}else{
+		concatenate_right(that);
+	}
+	return true;
+}
+
+///The number of nodes at each level is computed first: as few leaves as possible,
+///then as few branches as possible holding them, and so on up to the root.
+///The children are shared evenly between the nodes of a level, so all of them
+///are at least half-filled.
+template <typename T,int L,int M,typename A,typename P>
+btree_seq<T,L,M,A,P>::level_builder::level_builder(btree_seq *t,size_type n,size_type fill)
+	:tree(t),count(n),dep(0),top(0)
+{
+	nodes[0]=leaves_for(n,fill);
+	quot[0]=n/nodes[0];
+	rem[0]=n%nodes[0];
+	while(nodes[dep]>1){
+		nodes[dep+1]=(nodes[dep]+L-1)/L;
+		quot[dep+1]=nodes[dep]/nodes[dep+1];
+		rem[dep+1]=nodes[dep]%nodes[dep+1];
+		dep++;
+		open[dep]=0;
+		built[dep]=0;
+		sums[dep]=0;
+	}
+}
+
+///The branches are built bottom-up: each level has one open branch,
+///a complete branch goes to the open branch above.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::level_builder::add_leaf(Leaf *l)
+{
+	Node *child=l;
+	size_type d,k,sum=l->fillament;
+	for(d=1;d<=dep;d++){
+		if(open[d]==0){
+			try{
+				open[d]=tree->branch_alloc.allocate(1);
+				open[d]->init_refs();
+			}catch(...){
+				tree->burn_nodes(child,d-1);
+				throw;
+			}
+			open[d]->fillament=0;
+		}
+		Branch *br=open[d];
+		k=br->fillament;
+		br->children[k]=child;
+		child->parent=br;
+		child->place=k;
+		sums[d]+=sum;
+		br->nums[k]=P::prefix_counts?sums[d]:sum;
+		br->fillament=k+1;
+		if(k+1<quot[d]+((built[d]<rem[d])?1:0)){
+			return;
+		}
+		//the branch is complete
+		child=br;
+		sum=sums[d];
+		sums[d]=0;
+		open[d]=0;
+		built[d]++;
+	}
+	top=child;
+}
+
+///Destroying the open branches, they hold all the linked nodes.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::level_builder::abandon()
+{
+	for(size_type d=1;d<=dep;d++){
+		if(open[d]!=0){
+			tree->burn_nodes(open[d],d);
+		}
+	}
+}
+
+///The number of nodes above the leaves.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::level_builder::branches()const
+{
+	size_type res=0;
+	for(size_type d=1;d<=dep;d++){
+		res+=nodes[d];
+	}
+	return res;
+}
+
+///After the last leaf, all the branches are complete and top is the root.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::level_builder::finish()
+{
+	tree->root=top;
+	tree->root->parent=0;
+	tree->root->place=0;
+	tree->depth=dep;
+	tree->count=count;
+}
+
+///Bulk loading of n elements into the empty tree: the leaves are filled in order
+///and linked by the level builder. O(n).
+template <typename T,int L,int M,typename A,typename P> template <class InputIterator>
+void btree_seq<T,L,M,A,P>::build_tree(InputIterator first,InputIterator last,size_type n)
+{
+	assert_length(n);
+	level_builder lb(this,n);
+	try{
+		for(size_type j=0;j<lb.leaves();j++){
+			Leaf *l=leaf_alloc.allocate(1);
+			l->init_refs();
+			try{
+				l->fillament=fill_elements(l->elements,lb.leaf_size(j),first,last,
+					typename std::iterator_traits<InputIterator>::iterator_category());
+			}catch(...){
+				leaf_alloc.deallocate(l,1);
+				throw;
+			}
+			lb.add_leaf(l);
+		}
+	}catch(...){
+		lb.abandon();
+		throw;
+	}
+	lb.finish();
+}
+
+#if __cplusplus >= 201103L
+///Filling the leaves [from,to) of a parallel bulk load, run by each thread.
+///The exception is kept in error, the leaves not filled are left 0.
+template <typename T,int L,int M,typename A,typename P> template <class RandomAccessIterator>
+void btree_seq<T,L,M,A,P>::build_leaves(const level_builder &lb,Leaf **leaves,size_type from,size_type to,
+	RandomAccessIterator first,RandomAccessIterator last,std::exception_ptr &error)
+{
+	try{
+		for(size_type j=from;j<to;j++){
+			Leaf *l=leaf_alloc.allocate(1);
+			l->init_refs();
+			RandomAccessIterator cur=first+lb.leaf_start(j);
+			try{
+				l->fillament=fill_elements(l->elements,lb.leaf_size(j),cur,last,
+					std::random_access_iterator_tag());
+			}catch(...){
+				leaf_alloc.deallocate(l,1);
+				throw;
+			}
+			leaves[j]=l;
+		}
+	}catch(...){
+		error=std::current_exception();
+	}
+}
+
+//Implementation of the public parallel_assign function.
+template <typename T,int L,int M,typename A,typename P> template <class RandomAccessIterator>
+void btree_seq<T,L,M,A,P>::parallel_assign(RandomAccessIterator first,RandomAccessIterator last,unsigned threads)
+{
+	clear();
+	if(first==last){
+		return;
+	}
+	assert_length(last-first);
+	//the pools are not thread safe
+	leaf_alloc.release();
+	branch_alloc.release();
+	level_builder lb(this,last-first);
+	size_type j,num=lb.leaves();
+	if(threads==0){
+		threads=std::thread::hardware_concurrency();
+	}
+	if(threads==0){
+		threads=1;
+	}
+	if(threads>num){
+		threads=num;
+	}
+	std::vector<Leaf*> leaves(num,0);
+	std::vector<std::exception_ptr> errors(threads);
+	std::vector<std::thread> workers;
+	workers.reserve(threads);
+	unsigned t;
+	//the leaves of thread t are [num*t/threads,num*(t+1)/threads)
+	for(t=1;t<threads;t++){
+		try{
+			workers.push_back(std::thread(&btree_seq::template build_leaves<RandomAccessIterator>,this,
+				std::cref(lb),leaves.data(),num*t/threads,num*(t+1)/threads,first,last,std::ref(errors[t])));
+		}catch(...){//no more threads, the rest is done here
+			build_leaves(lb,leaves.data(),num*t/threads,num,first,last,errors[t]);
+			break;
+		}
+	}
+	build_leaves(lb,leaves.data(),0,num/threads,first,last,errors[0]);
+	for(t=0;t<workers.size();t++){
+		workers[t].join();
+	}
+	for(t=0;t<threads;t++){
+		if(errors[t]){
+			for(j=0;j<num;j++){
+				if(leaves[j]!=0){
+					burn_nodes(leaves[j],0);
+				}
+			}
+			std::rethrow_exception(errors[t]);
+		}
+	}
+	try{
+		for(j=0;j<num;j++){
+			lb.add_leaf(leaves[j]);
+		}
+	}catch(...){
+		lb.abandon();
+		for(j++;j<num;j++){
+			burn_nodes(leaves[j],0);
+		}
+		throw;
+	}
+	lb.finish();
+}
+#endif
+
+///Copying the subtree n of depth dep (of another tree) with the same shape.
+///If an exception occurs, the copied part is destroyed.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::Node *btree_seq<T,L,M,A,P>::clone_nodes(const Node *n,size_type dep)
+{
+	if(dep==0){
+		const Leaf *src=static_cast<const Leaf*>(n);
+		const_pointer first=src->elements,last=first+src->fillament;
+		Leaf *l=leaf_alloc.allocate(1);
+		l->init_refs();
+		try{
+			fill_elements(l->elements,src->fillament,first,last,std::random_access_iterator_tag());
+		}catch(...){
+			leaf_alloc.deallocate(l,1);
+			throw;
+		}
+		l->fillament=src->fillament;
+		return l;
+	}
+	const Branch *src=static_cast<const Branch*>(n);
+	Branch *br=branch_alloc.allocate(1);
+	br->init_refs();
+	Node *child;
+	br->fillament=0;
+	try{
+		for(size_type j=0;j<src->fillament;j++){
+			child=clone_nodes(src->children[j],dep-1);
+			br->children[j]=child;
+			child->parent=br;
+			child->place=j;
+			br->nums[j]=src->nums[j];
+			br->fillament=j+1;
+		}
+	}catch(...){
+		burn_nodes(br,dep);
+		throw;
+	}
+	return br;
+}
+
+///Copying the shared node n of depth dep for this tree (P::copy_on_write).
+///The elements of a leaf are copied, the children of a branch become shared
+///by both copies. The parent and place of the copy are set by the caller.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::Node *btree_seq<T,L,M,A,P>::copy_node(Node *n,size_type dep)
+{
+	Node *res;
+	if(dep==0){
+		Leaf *src=static_cast<Leaf*>(n);
+		const_pointer first=src->elements,last=first+src->fillament;
+		Leaf *l=leaf_alloc.allocate(1);
+		try{
+			fill_elements(l->elements,src->fillament,first,last,std::random_access_iterator_tag());
+		}catch(...){
+			leaf_alloc.deallocate(l,1);
+			throw;
+		}
+		l->fillament=src->fillament;
+		res=l;
+	}else{
+		Branch *src=static_cast<Branch*>(n);
+		Branch *br=branch_alloc.allocate(1);
+		for(size_type j=0;j<src->fillament;j++){
+			br->children[j]=src->children[j];
+			br->children[j]->add_ref();
+			br->nums[j]=src->nums[j];
+		}
+		br->fillament=src->fillament;
+		res=br;
+	}
+	res->init_refs();
+	burn_nodes(n,dep);//only released, unless a snapshot has released it meanwhile
+	modified();
+	return res;
+}
+
+///Making the nodes of subtree n of depth dep owned by this tree, where they
+///contain elements [first,last) relatively to n. Node n is already owned.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::own_nodes(Node *n,size_type dep,size_type first,size_type last)
+{
+	if(dep==0){
+		return;
+	}
+	Branch *b=static_cast<Branch*>(n);
+	size_type start=first,j=find_in_branch(b,start),num;
+	last-=first-start;
+	for(;;){
+		num=child_num(b,j);
+		own_nodes(own_child(b,j,dep-1),dep-1,start,last<num?last:num);
+		if(last<=num){
+			return;
+		}
+		last-=num;
+		start=0;
+		j++;
+	}
+}
+
+///Destroying the subtree n of depth dep: all its elements and nodes.
+///With P::copy_on_write, a node shared with another tree is only released.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::burn_nodes(Node *n,size_type dep)
+{
+	if(n->release()!=0){
+		return;
+	}
+	if(dep==0){
+		Leaf *l=static_cast<Leaf*>(n);
+		burn_elements(l->elements,l->fillament);
+		leaf_alloc.deallocate(l,1);
+	}else{
+		Branch *b=static_cast<Branch*>(n);
+		for(size_type j=0;j<b->fillament;j++){
+			burn_nodes(b->children[j],dep-1);
+		}
+		branch_alloc.deallocate(b,1);
+	}
+}
+
+///Freeing the branches of the subtree n, whose leaves are already freed.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::burn_branches(Node *n,size_type dep)
+{
+	if(dep==0){
+		return;
+	}
+	Branch *b=static_cast<Branch*>(n);
+	for(size_type j=0;(dep>1)&&(j<b->fillament);j++){
+		burn_branches(b->children[j],dep-1);
+	}
+	branch_alloc.deallocate(b,1);
+}
+
+///Destroying the elements in the leaves of the subtree n, the nodes are left
+///to their arena.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::burn_leaf_elements(Node *n,size_type dep)
+{
+	if(dep==0){
+		Leaf *l=static_cast<Leaf*>(n);
+		burn_elements(l->elements,l->fillament);
+	}else{
+		Branch *b=static_cast<Branch*>(n);
+		for(size_type j=0;j<b->fillament;j++){
+			burn_leaf_elements(b->children[j],dep-1);
+		}
+	}
+}
+
 ///The common engine for deletion of elements and visiting them.
 ///Params: action to perform, node to perform on, interval [start,start+diff) relatively to that node
 ///depth from the node to the bottom.
-template <typename T,int L,int M,typename A> template<typename Action>
-bool btree_seq<T,L,M,A>::recursive_action(Action &act,size_type start,size_type diff,size_type dep,Node *node)
+template <typename T,int L,int M,typename A,typename P> template<typename Action>
+bool btree_seq<T,L,M,A,P>::recursive_action(Action &act,size_type start,size_type diff,size_type dep,Node *node)
 {
 	while(dep>0){
 		if(diff==0){
 			return false;
 		}
 		Branch* b=static_cast<Branch*>(node);
-		size_type j=0,k,del;
-		while(start>=b->nums[j]){
-			start-=b->nums[j];
-			j++;
-		}
-		if((start+diff<=b->nums[j])&&(diff<b->nums[j])){
-			act.decrement_value(b->nums[j],diff);
+		size_type j,k,del,cur;
+		j=find_in_branch(b,start);
+		cur=child_num(b,j);
+		if((start+diff<=cur)&&(diff<cur)){
+			act.decrement_value(b,j,diff);
 			node=b->children[j];
 			dep--;
 			continue;
 		}
 		if(start>0){
 			del=diff;
-			if(b->nums[j]-start<del){
-				del=b->nums[j]-start;
+			if(cur-start<del){
+				del=cur-start;
 			}
 			if(recursive_action(act,start,del,dep-1,b->children[j])){
 				return true;
 			}
-			start+=del;
 			diff-=del;
-			act.decrement_value(b->nums[j],del);
+			act.decrement_value(b,j,del);
 			j++;
 		}
 		k=j;
-		while((diff>=b->nums[k])&&(diff>0)){
-			if(recursive_action(act,0,b->nums[k],dep-1,b->children[k])){
+		while((diff>0)&&(diff>=(cur=child_num(b,k)))){
+			if(k+1<b->fillament){
+				if(dep==1){
+					prefetch_leaf(b->children[k+1]);
+				}else{
+					prefetch_branch(b->children[k+1]);
+				}
+			}
+			if(!act.process_subtree(b->children[k],dep-1)&&
+				recursive_action(act,0,cur,dep-1,b->children[k])){
 				return true;
 			}
-			start+=b->nums[k];
-			diff-=b->nums[k];
+			diff-=cur;
 			k++;
 		}
 		if(diff>0){
 			if(recursive_action(act,0,diff,dep-1,b->children[k])){
 				return true;
 			}
-			act.decrement_value(b->nums[k],diff);
+			act.decrement_value(b,k,diff);
 		}
-		if(act.shift_array()){
-			move_children(b,j,b,k,b->fillament-k);
-			b->fillament=b->fillament+j-k;
+		if(act.shift_array()&&(k!=j)){
+			delete_children(b,j,k-j);
 			if(b->fillament==0){
 				branch_alloc.deallocate(b,1);
 			}
@@ -936,8 +1555,8 @@ bool btree_seq<T,L,M,A>::recursive_action(Action &act,size_type start,size_type
 }
 
 ///Processing leaf while deleting elements.
-template <typename T,int L,int M,typename A> 
-bool btree_seq<T,L,M,A>::erase_helper::process_leaf(Leaf *l,size_type start,size_type end)
+template <typename T,int L,int M,typename A,typename P> 
+bool btree_seq<T,L,M,A,P>::erase_helper::process_leaf(Leaf *l,size_type start,size_type end)
 {
 	leaves++;
 	if(l->fillament==end-start){
@@ -954,12 +1573,16 @@ bool btree_seq<T,L,M,A>::erase_helper::process_leaf(Leaf *l,size_type start,size
 }
 
 //Implementation of the public erase function.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::erase(size_type first,size_type last)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::erase(size_type first,size_type last)
 {
 	if(first==last){
 		return;
 	}
+	modified();
+	//only the paths to both ends are copied, the shared subtrees between them are released
+	own_range(first?first-1:0,first+1);
+	own_range(last-1,last+1);
 	erase_helper eh(*this);
 	recursive_action(eh,first,last-first,depth,root);
 	count=count+first-last;
@@ -971,11 +1594,11 @@ void btree_seq<T,L,M,A>::erase(size_type first,size_type last)
 }
 
 ///Processing leaf while visiting elements.
-template <typename T,int L,int M,typename A> template<typename V>
-bool btree_seq<T,L,M,A>::visitor_helper<V>::
+template <typename T,int L,int M,typename A,typename P> template<typename V,typename E>
+bool btree_seq<T,L,M,A,P>::visitor_helper<V,E>::
 	process_leaf(Leaf *l,size_type start,size_type end)
 {
-	T *p1=l->elements+start,*p2=l->elements+end;
+	E *p1=l->elements+start,*p2=l->elements+end;
 	while(p1!=p2){
 		if(v(*p1)){
 			iters+=(p1-l->elements)-start;
@@ -988,18 +1611,187 @@ bool btree_seq<T,L,M,A>::visitor_helper<V>::
 }
 
 //Implementation of the public visit function.
-template <typename T,int L,int M,typename A> template<typename V>
-typename btree_seq<T,L,M,A>::size_type
-	btree_seq<T,L,M,A>::visit(size_type first,size_type last,V& v)
+template <typename T,int L,int M,typename A,typename P> template<typename V>
+typename btree_seq<T,L,M,A,P>::size_type
+	btree_seq<T,L,M,A,P>::visit(size_type first,size_type last,V& v)
 {
-	visitor_helper<V> vh(v);
+	visitor_helper<V,T> vh(v);
+	if(first==last){
+		return first;
+	}
+	own_range(first,last);
 	recursive_action(vh,first,last-first,depth,root);
 	return first+vh.get_iters();
 }
 
+//Implementation of the public const visit function.
+template <typename T,int L,int M,typename A,typename P> template<typename V>
+typename btree_seq<T,L,M,A,P>::size_type
+	btree_seq<T,L,M,A,P>::visit(size_type first,size_type last,V& v)const
+{
+	visitor_helper<V,const T> vh(v);
+	if(first==last){
+		return first;
+	}
+	//the visitor changes neither the tree nor the elements
+	const_cast<btree_seq*>(this)->recursive_action(vh,first,last-first,depth,root);
+	return first+vh.get_iters();
+}
+
+//Implementation of the public erase_if function.
+template <typename T,int L,int M,typename A,typename P> template<typename Pred>
+typename btree_seq<T,L,M,A,P>::size_type
+	btree_seq<T,L,M,A,P>::erase_if(size_type first,size_type last,Pred pred)
+{
+	if(first>=last){
+		return 0;
+	}
+	own_range(first,last);
+	Leaf *rl,*wl;
+	size_type rpos=find_leaf(rl,first),wpos=rpos,ridx=0,widx;
+	Branch *rb=0,*wb;
+	if(depth!=0){//a single leaf is the root and has no place
+		rb=rl->parent;
+		ridx=rl->place;
+	}
+	wb=rb;
+	widx=ridx;
+	size_type done=first,kept=first,end;
+	wl=rl;
+	try{
+		while(done<last){
+			end=rl->fillament;
+			if(end-rpos>last-done){
+				end=rpos+last-done;
+			}
+			for(;rpos<end;++rpos,++done){
+				if(pred(rl->elements[rpos])){
+					continue;
+				}
+				if(wpos==wl->fillament){
+					wl=next_leaf(wb,widx);
+					wpos=0;
+				}
+				if(done!=kept){
+#if __cplusplus >= 201103L
+					wl->elements[wpos]=std::move(rl->elements[rpos]);
+#else
+					wl->elements[wpos]=rl->elements[rpos];
+#endif
+				}
+				++wpos;
+				++kept;
+			}
+			if(done<last){
+				rl=next_leaf(rb,ridx);
+				rpos=0;
+			}
+		}
+	}catch(...){
+		erase(kept,done);
+		throw;
+	}
+	erase(kept,last);
+	return last-kept;
+}
+
+//Implementation of the public gather function.
+template <typename T,int L,int M,typename A,typename P> template <class PosIterator,class OutputIterator>
+OutputIterator btree_seq<T,L,M,A,P>::gather(PosIterator first,PosIterator last,OutputIterator out)const
+{
+	hint h;
+	Leaf *l;
+	size_type found;
+	for(;first!=last;++first){
+		found=find_leaf(l,*first,h);
+		*out=l->elements[found];
+		++out;
+	}
+	return out;
+}
+
+//Implementation of the public scatter function.
+template <typename T,int L,int M,typename A,typename P> template <class PosIterator,class InputIterator>
+InputIterator btree_seq<T,L,M,A,P>::scatter(PosIterator first,PosIterator last,InputIterator values)
+{
+	hint h;
+	Leaf *l;
+	size_type found;
+	for(;first!=last;++first){
+		own_range(*first,*first+1);
+		found=find_leaf(l,*first,h);
+		l->elements[found]=*values;
+		++values;
+	}
+	return values;
+}
+
+///Adding the new elements of the leaf to the counters above it and to size().
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::appender::commit()
+{
+	size_type n=fill-leaf->fillament;
+	leaf->fillament=fill;
+	for(Node *c=leaf;c->parent!=0;c=c->parent){
+		add_to_child(c->parent,c->place,n);
+	}
+	tree->count+=n;
+	tree->modified();
+}
+
+///Finding the rightmost leaf on the first push_back, or linking a new empty leaf
+///to the right of the full one. The leaf is filled up to end, which stops
+///at max_size().
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::appender::grow()
+{
+	Leaf *l;
+	Branch *branch_bundle;
+	size_type room;
+	if(leaf==0){
+		if(tree->count==0){
+			tree->init_tree();
+		}
+		tree->own_range(tree->count-1,tree->count);
+		Node *n=tree->root;
+		for(size_type dep=tree->depth;dep;dep--){
+			Branch *b=static_cast<Branch*>(n);
+			n=b->children[b->fillament-1];
+		}
+		leaf=static_cast<Leaf*>(n);
+		fill=leaf->fillament;
+		tree->modified();
+	}else{
+		commit();
+	}
+	tree->assert_length(1);
+	if(fill==M){
+		tree->prepare_for_splitting(branch_bundle,l,leaf,tree->leaf_alloc);
+		l->fillament=0;
+		tree->split(leaf,l,0,branch_bundle);
+		leaf=l;
+		fill=0;
+	}
+	room=tree->max_size()-tree->count;
+	end=(room<M-fill)?fill+room:M;
+}
+
+//Implementation of the public appender::flush function.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::appender::flush()
+{
+	if(leaf!=0){
+		commit();
+		tree->underflow_leaf(leaf);
+		leaf=0;
+		fill=M;
+		end=M;
+	}
+}
+
 ///Concateneting that (small) tree to this big one, from the left or right side.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::insert_tree(btree_seq<T,L,M,A> &that,bool last)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::insert_tree(btree_seq<T,L,M,A,P> &that,bool last)
 {
 	Branch *branch_bundle=0,*parent;
 	Node *l;
@@ -1018,11 +1810,15 @@ void btree_seq<T,L,M,A>::insert_tree(btree_seq<T,L,M,A> &that,bool last)
 }
 
 //Implementation of public function concatenate_right.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::concatenate_right(btree_seq<T,L,M,A> &that)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::concatenate_right(btree_seq<T,L,M,A,P> &that)
 {
-	size_type pos,curdep;
+	size_type pos;
 	Branch *b;
+	assert(T_alloc==that.T_alloc);
+	assert_length(that.count);
+	modified();
+	that.modified();
 	if(count==0){
 		depth=that.depth;
 		root=that.root;
@@ -1033,53 +1829,67 @@ void btree_seq<T,L,M,A>::concatenate_right(btree_seq<T,L,M,A> &that)
 	if(that.count==0){
 		return;
 	}
+	own_range(count-1,count);
+	that.own_range(0,1);
 	pos=count;
 	if(that.depth==depth){
 		b=branch_alloc.allocate(1);
+		b->init_refs();
 		increase_depth(b);
 	}
 	if(that.depth<depth){
 		//we want to attach that (small) tree to this big from the right
 		insert_tree(that,true);
 	}else {
-		//we want to attach this (small) tree to that big from the left
-		that.insert_tree(*this,false);
-		swap(that);
+		//we want to attach this (small) tree to that big from the left,
+		//the nodes are taken from the allocators (and spare nodes) of this
+		swap_nodes(that);
+		try{
+			insert_tree(that,false);
+		}catch(...){
+			swap_nodes(that);
+			throw;
+		}
 	}
 	my_deep_sew(pos);
 }
 
 ///Detaching some (smaller) part of the tree to that tree from the left or right.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::detach_some
-	(btree_seq<T,L,M,A> &that,Branch *b,size_type dep,bool last)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::detach_some
+	(btree_seq<T,L,M,A,P> &that,Branch *b,size_type dep,bool last)
 {
 	Node *dummy;
 	size_type idx=last?b->fillament-1:0,pos=last?count-1:0;
 	that.clear();
 	that.root=b->children[idx];
 	that.root->parent=0;
+	that.root->place=0;
 	that.depth=dep;
-	that.count=b->nums[idx];
+	that.count=child_num(b,idx);
 	find_leaf(dummy,pos,-static_cast<diff_type>(that.count),dep);
 	delete_children(b,idx,1);
 }
 
 //Implementation of the public split_right function.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::split_right
-	(btree_seq<T,L,M,A> &that,size_type pos)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::split_right
+	(btree_seq<T,L,M,A,P> &that,size_type pos)
 {
 	Branch *branch_bundle=0;
+	assert(T_alloc==that.T_alloc);
 	if(pos==count){
 		that.clear();
 		return;
 	}	
 	if(pos==0){
 		that.clear();
-		swap(that);
+		swap_nodes(that);
 		return;
 	}
+	modified();
+	that.modified();
+	own_range(pos-1,pos+1);
 	//This function splits nodes and leafs from bottom to top
 	//until leftmost or rightmost branch represent one of desired parts
 	//of splitting operations.
@@ -1101,13 +1911,13 @@ void btree_seq<T,L,M,A>::split_right
 		for(;;){
 			parent=n->parent;
 			idx=find_child(parent,n);
-			if((idx==0)&&(parent->nums[0]==pos)){
+			if((idx==0)&&(child_num(parent,0)==pos)){
 				//If complete detach left can be performed at this level.
 				detach_some(that,parent,dep,false);
-				swap(that);
+				swap_nodes(that);
 				break;
 			}
-			if((idx==parent->fillament-2)&&(parent->nums[parent->fillament-1]==count-pos)){
+			if((idx==parent->fillament-2)&&(child_num(parent,parent->fillament-1)==count-pos)){
 				//If complete detach right can be performaed at this level.
 				detach_some(that,parent,dep,true);
 				break;
@@ -1132,41 +1942,485 @@ void btree_seq<T,L,M,A>::split_right
 }
 
 //Implementation of the public concatenate_left function.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::concatenate_left(btree_seq<T,L,M,A> &that)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::concatenate_left(btree_seq<T,L,M,A,P> &that)
 {
 	that.concatenate_right(*this);
-	swap(that);	
+	swap_nodes(that);
 }
 
 //Implementation of the public split_left function.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::split_left(btree_seq<T,L,M,A> &that,size_type pos)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::split_left(btree_seq<T,L,M,A,P> &that,size_type pos)
 {
-	swap(that);	
+	swap_nodes(that);
 	that.split_right(*this,pos);
 }
 
+//Implementation of the public freeze function.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::freeze(frozen_view &view)
+{
+	view.release_index();
+	view.tree.clear();
+	view.tree.swap(*this);
+	try{
+		view.build_index();
+	}catch(...){
+		view.tree.swap(*this);
+		throw;
+	}
+}
+
+//Implementation of the public thaw function.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::thaw(frozen_view &view)
+{
+	clear();
+	view.release_index();
+	swap(view.tree);
+}
+
+///Number of leaves in the subtree n of depth dep.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::count_leaves
+	(Node *n,size_type dep)
+{
+	size_type res=0;
+	if(dep==0){
+		return 1;
+	}
+	Branch *b=static_cast<Branch*>(n);
+	for(size_type j=0;j<b->fillament;j++){
+		res+=count_leaves(b->children[j],dep-1);
+	}
+	return res;
+}
+
+///Building the index of leaves: ends and entries in Eytzinger order.
+///If there is not enough memory, the view keeps no index.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::frozen_view::build_index()
+{
+	size_type k=1,sum=0;
+	if(tree.count==0){
+		return;
+	}
+	Ends_alloc_type ends_alloc(tree.T_alloc);
+	Entries_alloc_type entries_alloc(tree.T_alloc);
+	leaves=tree.count_leaves(tree.root,tree.depth);
+	ends=ends_alloc.allocate(leaves+1);
+	try{
+		entries=entries_alloc.allocate(leaves+1);
+	}catch(...){
+		ends_alloc.deallocate(ends,leaves+1);
+		ends=0;
+		leaves=0;
+		throw;
+	}
+	//in-order traversal of the implicit tree starts from the leftmost node
+	while(2*k<=leaves){
+		k*=2;
+	}
+	index_leaves(tree.root,tree.depth,k,sum);
+}
+
+///Freeing the index of leaves.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::frozen_view::release_index()
+{
+	if(leaves!=0){
+		Ends_alloc_type ends_alloc(tree.T_alloc);
+		Entries_alloc_type entries_alloc(tree.T_alloc);
+		ends_alloc.deallocate(ends,leaves+1);
+		entries_alloc.deallocate(entries,leaves+1);
+		ends=0;
+		entries=0;
+		leaves=0;
+	}
+}
+
+///Putting leaves of the subtree n into the index, k is the current node
+///of the implicit tree, sum is the number of elements before n.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::frozen_view::index_leaves
+	(Node *n,size_type dep,size_type &k,size_type &sum)
+{
+	if(dep==0){
+		Leaf *l=static_cast<Leaf*>(n);
+		entries[k].leaf=l;
+		entries[k].first=sum;
+		sum+=l->fillament;
+		ends[k]=sum;
+		//the next node in-order
+		if(2*k+1<=leaves){
+			k=2*k+1;
+			while(2*k<=leaves){
+				k*=2;
+			}
+		}else{
+			while(k&1){
+				k>>=1;
+			}
+			k>>=1;
+		}
+	}else{
+		Branch *b=static_cast<Branch*>(n);
+		for(size_type j=0;j<b->fillament;j++){
+			index_leaves(b->children[j],dep-1,k,sum);
+		}
+	}
+}
+
+//Implementation of the public frozen_view::at function.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::const_reference
+	btree_seq<T,L,M,A,P>::frozen_view::at(size_type pos)const
+{
+	if(pos>=size()){
+		throw std::out_of_range("Index exceeds container size.");
+	}
+	return (*this)[pos];
+}
+
+#if __cplusplus >= 201103L
+//Implementation of the public publish function.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::publish()
+{
+	Node *old_root;
+	size_type old_depth,old_count;
+	if(count!=0){
+		root->add_ref();
+	}
+	{
+		std::lock_guard<std::mutex> guard(published.lock);
+		old_root=published.root;
+		old_depth=published.depth;
+		old_count=published.count;
+		published.root=root;
+		published.depth=depth;
+		published.count=count;
+	}
+	if(old_count!=0){
+		burn_nodes(old_root,old_depth);
+	}
+}
+
+//Implementation of the public snapshot function.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::snapshot_view btree_seq<T,L,M,A,P>::snapshot()const
+{
+	snapshot_view res(T_alloc);
+	std::lock_guard<std::mutex> guard(published.lock);
+	if(published.count!=0){
+		published.root->add_ref();
+		res.tree.root=published.root;
+		res.tree.depth=published.depth;
+		res.tree.count=published.count;
+	}
+	return res;
+}
+
+//Implementation of the public snapshot_view::at function.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::const_reference
+	btree_seq<T,L,M,A,P>::snapshot_view::at(size_type pos)const
+{
+	if(pos>=size()){
+		throw std::out_of_range("Index exceeds container size.");
+	}
+	return (*this)[pos];
+}
+#endif
+
 //Implementation of the public assign function.
-template <typename T,int L,int M,typename A>
-	void btree_seq<T,L,M,A>::assign(size_type n,const value_type &val)
+template <typename T,int L,int M,typename A,typename P>
+	void btree_seq<T,L,M,A,P>::assign(size_type n,const value_type &val)
 {
 	clear();
 	fill(0,n,val);
 }
 
+//Implementation of the public reserve function.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::reserve(size_type n)
+{
+	if(n<=count){
+		return;
+	}
+	//A leaf other than the root holds at least M/2 elements, and until an insert is
+	//sewn together only the two leaves at its ends may hold fewer, so growing up to n
+	//elements takes at most n/(M/2)+2 leaves at a time. Likewise, above a level of x
+	//nodes there are at most x/(L/2) branches which are not roots, and two roots: that
+	//of the tree and that of a range which insert builds separately, until both are
+	//concatenated under one more root. There are at most as many levels as
+	//x=ceil(x/(L/2)) takes to reach 1. The present nodes, at least as many as full
+	//ones holding count elements, are subtracted.
+	size_type leaves=n/(M/2)+2,branches=1,x=leaves,b=leaves,y=(count+M-1)/M;
+	for(;x>1;x=(x+L/2-1)/(L/2)){
+		b=b/(L/2)+2;
+		branches+=b;
+	}
+	leaves-=y;
+	while(y>1){
+		y=(y+L-1)/L;
+		branches-=y;
+	}
+	leaf_alloc.reserve(leaves);
+	branch_alloc.reserve(branches);
+}
+
+///As many leaves as filling up to fill needs, but no more than half-filled ones
+///and no fewer than full ones.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::leaves_for(size_type n,size_type fill)
+{
+	size_type res=(n+fill-1)/fill;
+	if(res>n/(M/2)){
+		res=n/(M/2);
+	}
+	if(res<(n+M-1)/M){
+		res=(n+M-1)/M;
+	}
+	return res;
+}
+
+//Implementation of the public shrink_to_fit function.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::shrink_to_fit()
+{
+	repack(M,false);
+}
+
+//Implementation of the public compact function.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::compact(size_type leaf_fill)
+{
+	repack((leaf_fill<M/2)?M/2:(leaf_fill>M)?M:leaf_fill,true);
+}
+
+///Moving all the elements into a new tree with leaves filled up to fill.
+///The emptied old leaves are used again, unless the new nodes are relocated in
+///the order of addresses; then all of them are allocated first and the old ones freed.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::repack(size_type fill,bool relocate)
+{
+	leaf_alloc.release();
+	branch_alloc.release();
+	if(count==0){
+		return;
+	}
+	modified();
+	own_range(0,count);
+	level_builder lb(this,count,fill);
+	size_type j,k,n,done,pos=0,num=lb.leaves(),idx=0,old_depth=depth,extra=num,emptied=0;
+	Node *old_root=root;
+	Leaf *old,*l;
+	Branch *b=0;
+	find_leaf(old,0);
+	if(depth!=0){
+		b=old->parent;
+		idx=old->place;
+	}
+	if(!relocate){
+		//only as many leaves as the new ones get ahead of the emptied old ones
+		Leaf *o=old;
+		Branch *ob=b;
+		size_type oidx=idx,end=o->fillament;
+		for(extra=0,j=0,done=0;j<num;done+=lb.leaf_size(j),j++){
+			while(end<=done){
+				emptied++;
+				o=next_leaf(ob,oidx);
+				end+=o->fillament;
+			}
+			if(j+1>emptied+extra){
+				extra=j+1-emptied;
+			}
+		}
+	}
+	//the new nodes are allocated first, nothing throws later
+	try{
+		leaf_alloc.reserve(extra);
+		branch_alloc.reserve(lb.branches());
+	}catch(...){
+		leaf_alloc.release();
+		branch_alloc.release();
+		throw;
+	}
+	if(relocate){
+		leaf_alloc.order();
+		branch_alloc.order();
+	}else{
+		leaf_alloc.keep_freed(num);
+	}
+	for(j=0;j<num;j++){
+		l=leaf_alloc.allocate(1);
+		l->init_refs();
+		n=lb.leaf_size(j);
+		for(done=0;done<n;done+=k){
+			k=old->fillament-pos;
+			if(k>n-done){
+				k=n-done;
+			}
+			move_elements_inc(l->elements+done,old->elements+pos,k);
+			pos+=k;
+			if(pos==old->fillament){//the emptied leaf goes to the pool and is used again
+				Leaf *next=(old_depth!=0)?next_leaf(b,idx):0;
+				leaf_alloc.deallocate(old,1);
+				old=next;
+				pos=0;
+			}
+		}
+		l->fillament=n;
+		lb.add_leaf(l);
+	}
+	burn_branches(old_root,old_depth);
+	lb.finish();
+	leaf_alloc.release();
+	branch_alloc.release();
+}
+
+//Implementation of the public incremental compact function.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::compact(size_type pos,
+	size_type max_leaves,size_type leaf_fill)
+{
+	if(depth==0||pos>=count){
+		return count;
+	}
+	size_type k,n,start,done=0,fill=(leaf_fill<M/2)?M/2:(leaf_fill>M)?M:leaf_fill;
+	Leaf *l;
+	Branch *b;
+	modified();
+	do{
+		//the whole lowest branch containing pos is compacted
+		start=branch_start(pos,n);
+		own_range(start,start+n);
+		find_leaf(l,start);
+		b=l->parent;
+		done+=b->fillament;
+		compact_branch(b,fill);
+		if(depth==0){
+			return count;
+		}
+		//if thin branches were merged, the branch now holding start is compacted
+		//again, so that none of its leaves is skipped
+		pos=branch_start(start,k);
+		if(pos==start&&k==n){
+			pos=start+n;
+		}
+	}while(pos<count&&done<max_leaves);
+	return pos;
+}
+
+///The first element of the lowest branch holding the element pos, n is set
+///to the number of elements in it.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::size_type btree_seq<T,L,M,A,P>::branch_start(size_type pos,size_type &n)
+{
+	Leaf *l;
+	size_type j,start=pos-find_leaf(l,pos);
+	Branch *b=l->parent;
+	for(j=0;j<l->place;j++){
+		start-=child_num(b,j);
+	}
+	for(n=0,j=0;j<b->fillament;j++){
+		n+=child_num(b,j);
+	}
+	return start;
+}
+
+///Moving the elements of the leaves of b into new leaves, sorted by address.
+///Nothing is changed if the leaves are in order already and are not too many.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::compact_branch(Branch *b,size_type fill)
+{
+	size_type j,k,size,done,pos=0,idx=0,n=0,num=b->fillament;
+	Leaf *leaves[L],*old=static_cast<Leaf*>(b->children[0]);
+	for(j=0;j<num;j++){
+		n+=child_num(b,j);
+	}
+	size_type cnt=leaves_for(n,fill);
+	if(cnt>num){
+		cnt=num;
+	}
+	if(cnt==num){
+		for(j=1;j<num&&b->children[j-1]<b->children[j];j++);
+		if(j==num){
+			return;
+		}
+	}
+	//the new leaves are allocated first, nothing throws later
+	for(j=0;j<cnt;j++){
+		try{
+			leaves[j]=leaf_alloc.allocate(1);
+		}catch(...){
+			while(j>0){
+				leaf_alloc.deallocate(leaves[--j],1);
+			}
+			throw;
+		}
+		leaves[j]->init_refs();
+		for(k=j;k>0&&leaves[k]<leaves[k-1];k--){
+			Leaf *tmp=leaves[k];
+			leaves[k]=leaves[k-1];
+			leaves[k-1]=tmp;
+		}
+	}
+	for(j=0;j<cnt;j++){
+		Leaf *l=leaves[j];
+		size=n/cnt+((j<n%cnt)?1:0);
+		for(done=0;done<size;done+=k){
+			k=old->fillament-pos;
+			if(k>size-done){
+				k=size-done;
+			}
+			move_elements_inc(l->elements+done,old->elements+pos,k);
+			pos+=k;
+			if(pos==old->fillament){
+				leaf_alloc.deallocate(old,1);
+				idx++;
+				old=(idx<num)?static_cast<Leaf*>(b->children[idx]):0;
+				pos=0;
+			}
+		}
+		l->fillament=size;
+	}
+	for(j=0,done=0;j<cnt;j++){
+		done+=leaves[j]->fillament;
+		b->children[j]=leaves[j];
+		leaves[j]->parent=b;
+		leaves[j]->place=j;
+		b->nums[j]=P::prefix_counts?done:leaves[j]->fillament;
+	}
+	b->fillament=cnt;
+	if(cnt<num){
+		underflow_branch(b);
+	}
+}
+
 //Assert that n<count
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::assert_range(size_type n)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::assert_range(size_type n)
 {
 	if(n>=size()){
 		throw std::out_of_range("Index exceeds container size.");
 	}
 }
 
+//Throw length_error, if n more elements do not fit into the counters.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::assert_length(size_type n)const
+{
+	if(n>max_size()-count){
+		throw std::length_error("Container size exceeds max_size().");
+	}
+}
+
 //Implementation of the public resize function.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::resize(size_type n,const value_type& val)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::resize(size_type n,const value_type& val)
 {
 	if(n<size()){
 		erase(n,size());
@@ -1176,48 +2430,177 @@ void btree_seq<T,L,M,A>::resize(size_type n,const value_type& val)
 }
 
 //Implementation of the public swap function.
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::swap(btree_seq<T,L,M,A> &that)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::swap(btree_seq<T,L,M,A,P> &that)
 {
+	typedef ___alexkupri_helpers::my_alloc_traits<A> traits;
+	if(traits::propagate_on_swap||T_alloc==that.T_alloc){
+		swap_trees(that,___alexkupri_helpers::my_bool<traits::propagate_on_swap!=0>());
+#if __cplusplus >= 201103L
+		swap_published(that.published);
+#endif
+	}else{
+		swap_elements(that);
+	}
+}
+
+///Exchanging only the trees. The nodes are freed by the allocator of the other
+///container afterwards, so the allocators must be equal (or be exchanged too).
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::swap_nodes(btree_seq<T,L,M,A,P> &that)
+{
+	assert(T_alloc==that.T_alloc);
+	modified();
+	that.modified();
 	std::swap(root,that.root);
 	std::swap(count,that.count);
 	std::swap(depth,that.depth);
 }
 
+///Exchanging the trees together with their allocators, the spare nodes of reserve as well.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::swap_trees(btree_seq<T,L,M,A,P> &that,
+	___alexkupri_helpers::my_bool<true>)
+{
+	std::swap(T_alloc,that.T_alloc);
+	branch_alloc.swap(that.branch_alloc);
+	leaf_alloc.swap(that.leaf_alloc);
+	modified();
+	that.modified();
+	std::swap(root,that.root);
+	std::swap(count,that.count);
+	std::swap(depth,that.depth);
+}
+
+///Swapping with a container having an unequal allocator, which stays with
+///its container: the elements of each one are put into new nodes of the other.
+///The nodes are reserved first, then the elements are moved, if that can not throw,
+///or copied, so both containers are unchanged if an exception is thrown.
+///Only a type, which can be moved but not copied, is moved anyway.
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::swap_elements(btree_seq<T,L,M,A,P> &that)
+{
+	btree_seq mine(T_alloc),theirs(that.T_alloc);
+	mine.reserve(that.count);
+	theirs.reserve(count);
+#if __cplusplus >= 201103L
+	typedef typename ___alexkupri_helpers::my_select<std::is_nothrow_move_constructible<T>::value||
+		!std::is_copy_constructible<T>::value,std::move_iterator<iterator>,iterator>::type source;
+	mine.insert(0,source(that.begin()),source(that.end()));
+	theirs.insert(0,source(begin()),source(end()));
+#else
+	mine.insert(0,that.begin(),that.end());
+	theirs.insert(0,begin(),end());
+#endif
+	clear();
+	that.clear();
+	swap_nodes(mine);
+	that.swap_nodes(theirs);
+}
+
+///Finding the leaf next to child idx of branch b, climbing up only as far
+///as necessary. Returns 0 for the last leaf, otherwise b and idx point to it.
+///Amortized constant time per leaf for a sequential scan.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::Leaf *btree_seq<T,L,M,A,P>::next_leaf(Branch *&b,size_type &idx)
+{
+	Branch *cur=b,*parent;
+	size_type j=idx,up=1;
+	while(j+1==cur->fillament){
+		parent=cur->parent;
+		if(parent==0){
+			return 0;
+		}
+		j=find_child(parent,cur);
+		cur=parent;
+		up++;
+	}
+	j++;
+	Node *n=cur->children[j];
+	while(--up){
+		cur=static_cast<Branch*>(n);
+		j=0;
+		n=cur->children[0];
+	}
+	b=cur;
+	idx=j;
+	return static_cast<Leaf*>(n);
+}
+
+///Finding the leaf previous to child idx of branch b, see next_leaf.
+template <typename T,int L,int M,typename A,typename P>
+typename btree_seq<T,L,M,A,P>::Leaf *btree_seq<T,L,M,A,P>::prev_leaf(Branch *&b,size_type &idx)
+{
+	Branch *cur=b,*parent;
+	size_type j=idx,up=1;
+	while(j==0){
+		parent=cur->parent;
+		if(parent==0){
+			return 0;
+		}
+		j=find_child(parent,cur);
+		cur=parent;
+		up++;
+	}
+	j--;
+	Node *n=cur->children[j];
+	while(--up){
+		cur=static_cast<Branch*>(n);
+		j=cur->fillament-1;
+		n=cur->children[j];
+	}
+	b=cur;
+	idx=j;
+	return static_cast<Leaf*>(n);
+}
+
 ///Iterator rebase function.
 ///It adjusts iterator's data according to tree and abs_idx.
-template <typename T,int L,int M,typename A>
+template <typename T,int L,int M,typename A,typename P>
 template <typename TT>
-typename btree_seq<T,L,M,A>::template iterator_base<TT>::pointer
-	btree_seq<T,L,M,A>::iterator_base<TT>::rebase()const
+typename btree_seq<T,L,M,A,P>::template iterator_base<TT>::pointer
+	btree_seq<T,L,M,A,P>::iterator_base<TT>::rebase()const
 {
 	size_type t1;
 	Leaf *l;
 	//we access element, so iterator must point to correct value
 	//we do these asserts only once per leaf, so debug version is not very slow
 	//Firstly, we are trying some simple fast cases
-	if(tree->depth==0){//tree has only one leaf, we don't call find_leaf
+	if(P::copy_on_write!=0){//parents of shared nodes are not valid, next_leaf can not be used
+		rel_idx=tree->find_leaf_for(l,abs_idx,elems);
+		br=0;
+	}else if(tree->depth==0){//tree has only one leaf, we don't call find_leaf
 		l=static_cast<Leaf*>(tree->root);
 		rel_idx=abs_idx;
 		br=0;
 	}else{
 		t1=rel_idx-avail_ptr;
-		if((t1<M/2)&&(br!=0)&&(br->fillament!=idx_in_br+1)){//we want next leaf, it's faster than find_leaf
-			rel_idx-=avail_ptr;
-			idx_in_br++;
-			l=static_cast<Leaf*>(br->children[idx_in_br]);
+		l=0;
+		if((t1<M/2)&&(br!=0)){//we want next leaf, it's faster than find_leaf
+			l=next_leaf(br,idx_in_br);
+			if(l){
+				rel_idx-=avail_ptr;
+				if(idx_in_br+1<br->fillament){//the scan is likely to go on
+					prefetch_leaf(br->children[idx_in_br+1]);
+				}
+			}
 		}else{
 			t1=-rel_idx;
-			if((t1<M/2)&&(br!=0)&&(idx_in_br!=0)){//previous leaf
-				idx_in_br--;
-				l=static_cast<Leaf*>(br->children[idx_in_br]);
-				rel_idx+=l->fillament;
-			}else{
-				rel_idx=tree->find_leaf(l,abs_idx);//general case
-				br=l->parent;
-				idx_in_br=find_child(br,l);
+			if((t1<M/2)&&(br!=0)){//previous leaf
+				l=prev_leaf(br,idx_in_br);
+				if(l){
+					rel_idx+=l->fillament;
+					if(idx_in_br>0){
+						prefetch_leaf(br->children[idx_in_br-1]);
+					}
+				}
 			}
 		}
+		if(l==0){
+			rel_idx=tree->find_leaf(l,abs_idx);//general case
+			br=l->parent;
+			idx_in_br=find_child(br,l);
+		}
 	}
 	avail_ptr=l->fillament;
 	elems=&l->elements[0];
@@ -1227,16 +2610,16 @@ typename btree_seq<T,L,M,A>::template iterator_base<TT>::pointer
 
 //==================== Debug functions ==============
 
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::my_assert(bool b,const char *msg)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::my_assert(bool b,const char *msg)
 {
 	if(!b){
 		throw std::runtime_error(msg);
 	}
 }
 
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::check_node(Node* c,size_type sum,bool head,size_type dep,Branch *parent)
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::check_node(Node* c,size_type sum,bool head,size_type dep,Branch *parent)
 {
 	size_type j,summ=0;
 	if(dep>0){
@@ -1246,12 +2629,19 @@ void btree_seq<T,L,M,A>::check_node(Node* c,size_type sum,bool head,size_type de
 		}
 		my_assert(b->fillament>1,"Head branch must be filled.");
 		for(j=0;j<b->fillament;j++){
-			summ+=b->nums[j];
+			summ+=child_num(b,j);
 		}
 		my_assert(sum==summ,"Sum of elements must be equal to the node sum.");
-		my_assert(b->parent==parent,"Parent must be correct.");
+		//with P::copy_on_write, only the nodes on the paths of modifications have valid parents
+		if(P::copy_on_write==0){
+			my_assert(b->parent==parent,"Parent must be correct.");
+			for(j=0;j<b->fillament;j++){
+				my_assert(b->children[j]->place==j,"Place in parent must be correct.");
+			}
+		}
+		my_assert(b->use_count()>=1,"Node must be referred to.");
 		for(j=0;j<b->fillament;j++){
-			check_node(b->children[j],b->nums[j],false,dep-1,b);
+			check_node(b->children[j],child_num(b,j),false,dep-1,b);
 		}
 	}else{
 		Leaf *l=static_cast<Leaf*>(c);
@@ -1260,20 +2650,21 @@ void btree_seq<T,L,M,A>::check_node(Node* c,size_type sum,bool head,size_type de
 			my_assert(l->fillament>=M/2,"In multileaf tree, leaves must be at least half-filled.");
 		}
 		my_assert(l->fillament==sum,"Sum is the number of children in leaf.");
-		my_assert(l->parent==parent,"Parent in leaf must be correct.");
+		my_assert((P::copy_on_write!=0)||(l->parent==parent),"Parent in leaf must be correct.");
+		my_assert(l->use_count()>=1,"Node must be referred to.");
 	}
 }
 
-template <typename T,int L,int M,typename A>
-void btree_seq<T,L,M,A>::__check_consistency()
+template <typename T,int L,int M,typename A,typename P>
+void btree_seq<T,L,M,A,P>::__check_consistency()
 {
 	if(count!=0){
 		check_node(root,count,true,depth,0);
 	}
 }
 
-template <typename T,int L,int M,typename A> template <class output_stream>
-void btree_seq<T,L,M,A>::
+template <typename T,int L,int M,typename A,typename P> template <class output_stream>
+void btree_seq<T,L,M,A,P>::
 	output_node(output_stream &o,Node* c,size_type tabs,size_type dep)
 {
 	size_type j;
@@ -1284,7 +2675,7 @@ void btree_seq<T,L,M,A>::
 		Branch *b=static_cast<Branch*>(c);
 		o<<"B "<<b<<":"<<b->parent;
 		for(j=0;j<b->fillament;j++){
-			o<<" "<<b->nums[j];
+			o<<" "<<child_num(b,j);
 		}
 		o<<"{\n";
 		for(j=0;j<b->fillament;j++){
@@ -1303,8 +2694,8 @@ void btree_seq<T,L,M,A>::
 	}
 }
 
-template <typename T,int L,int M,typename A> template <class output_stream>
-void btree_seq<T,L,M,A>::
+template <typename T,int L,int M,typename A,typename P> template <class output_stream>
+void btree_seq<T,L,M,A,P>::
 	__output(output_stream &o,const char *comm)
 {
 	o<<count<<" "<<comm<<"\n";
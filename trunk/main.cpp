@@ -24,6 +24,10 @@
 #include <iomanip>
 #include <algorithm>
 #include <cmath>
+#if __cplusplus >= 201103L
+#include <thread>
+#include <atomic>
+#endif
 #include "btree_seq.h"
  
 using namespace std;
@@ -112,10 +116,10 @@ TestDescriptor::~TestDescriptor()
 }
 
 //========== Container class for comparing results =================
-template <typename T,typename Alloc=std::allocator<T> >
+template <typename T,typename Alloc=std::allocator<T>,typename Policy=btree_seq_default_policy>
 class MultipleChecker
 {
-	btree_seq<T,MM,NN,Alloc> aka;
+	btree_seq<T,MM,NN,Alloc,Policy> aka;
 	vector<T> vi;
 	void Check();
 	int i1,im,d1,dm;
@@ -138,8 +142,8 @@ public:
 	}
 };
 
-template <typename T,typename Alloc>
-void MultipleChecker<T,Alloc>::insert(int pos,T val)
+template <typename T,typename Alloc,typename Policy>
+void MultipleChecker<T,Alloc,Policy>::insert(int pos,T val)
 {
 	if(b){
 		cout<<"Ins "<<pos<<";"<<vi.size()<<"\n";
@@ -157,8 +161,8 @@ retry:
 	i1++;
 }
 
-template <typename T,typename Alloc>
-void MultipleChecker<T,Alloc>::insert(int pos,const T *start,const T *finish)
+template <typename T,typename Alloc,typename Policy>
+void MultipleChecker<T,Alloc,Policy>::insert(int pos,const T *start,const T *finish)
 {
 	if(b){
 		cout<<"Ins "<<pos<<" "<<(finish-start)<<";"<<vi.size()<<"\n";
@@ -176,8 +180,8 @@ retry:
 	im++;
 }
 
-template <typename T,typename Alloc>
-void MultipleChecker<T,Alloc>::erase(int pos)
+template <typename T,typename Alloc,typename Policy>
+void MultipleChecker<T,Alloc,Policy>::erase(int pos)
 {
 	if(b){
 		cout<<"Del "<<pos<<";"<<vi.size()<<"\n";
@@ -188,8 +192,8 @@ void MultipleChecker<T,Alloc>::erase(int pos)
 	d1++;
 }
 
-template <typename T,typename Alloc>
-void MultipleChecker<T,Alloc>::erase(int first,int last)
+template <typename T,typename Alloc,typename Policy>
+void MultipleChecker<T,Alloc,Policy>::erase(int first,int last)
 {
 	if(b){
 		cout<<"Del "<<first<<" "<<last<<";"<<vi.size()<<"\n";
@@ -200,8 +204,8 @@ void MultipleChecker<T,Alloc>::erase(int first,int last)
 	dm++;
 }
 
-template <typename T,typename Alloc>
-void MultipleChecker<T,Alloc>::Check()
+template <typename T,typename Alloc,typename Policy>
+void MultipleChecker<T,Alloc,Policy>::Check()
 {
 	size_t j;
 	assert(vi.size()==aka.size());
@@ -405,6 +409,331 @@ void BasicTest_Int()
 	}
 }
 
+void BasicTest_Prefix()
+{
+	TestDescriptor t1("Test of four operations with prefix sums in branches.");
+	{
+		MultipleChecker<IntContainer,std::allocator<IntContainer>,btree_seq_prefix_policy> mc;
+		vector<IntContainer> vi;
+		int j;
+		vi.resize(600);
+		for(j=0;j<600;j++){
+			vi[j].set(j);
+		}
+		PerformCheck(mc,vi,600000,75,85,95,98,10);
+		PerformCheck(mc,vi,600000,50,60,90,100,10);
+		PerformCheck(mc,vi,600000,50,95,95,95,10);
+	}
+}
+
+void BasicTest_Prefetch()
+{
+	TestDescriptor t1("Test of four operations with software prefetch.");
+	{
+		MultipleChecker<IntContainer,std::allocator<IntContainer>,btree_seq_prefetch_policy> mc;
+		vector<IntContainer> vi;
+		int j;
+		vi.resize(600);
+		for(j=0;j<600;j++){
+			vi[j].set(j);
+		}
+		PerformCheck(mc,vi,600000,75,85,95,98,10);
+		PerformCheck(mc,vi,600000,50,60,90,100,10);
+		PerformCheck(mc,vi,600000,50,95,95,95,10);
+	}
+}
+
+struct AlignedCowPolicy:public btree_seq_aligned_policy
+{
+	enum {copy_on_write=1};
+};
+
+void BasicTest_Aligned()
+{
+	TestDescriptor t1("Test of four operations with aligned nodes.");
+	{
+		MultipleChecker<IntContainer,std::allocator<IntContainer>,btree_seq_aligned_policy> mc;
+		vector<IntContainer> vi;
+		int j;
+		vi.resize(600);
+		for(j=0;j<600;j++){
+			vi[j].set(j);
+		}
+		PerformCheck(mc,vi,600000,75,85,95,98,10);
+		PerformCheck(mc,vi,600000,50,95,95,95,10);
+		btree_seq<int,MM,NN,std::allocator<int>,btree_seq_aligned_policy> a;
+		for(j=0;j<100;j++){
+			a.insert(a.begin(),j);
+			assert(reinterpret_cast<size_t>(&a[0])%64==32);
+		}
+		btree_seq<int,btree_seq_nodes<int>::L,btree_seq_nodes<int>::M,
+			std::allocator<int>,btree_seq_aligned_policy> b(1000,5);
+		assert(reinterpret_cast<size_t>(&b[0])%64==32);
+		//the reference count of copy_on_write moves the elements to the next 32 bytes
+		btree_seq<int,MM,NN,std::allocator<int>,AlignedCowPolicy> c(100,5);
+		assert(reinterpret_cast<size_t>(&c[0])%64==(sizeof(size_t)==8?0:32));
+	}
+}
+
+struct NarrowPrefixPolicy:public btree_seq_narrow_policy
+{
+	enum {prefix_counts=1};
+};
+
+void BasicTest_Narrow()
+{
+	TestDescriptor t1("Test of four operations with 32-bit counters.");
+	{
+		MultipleChecker<IntContainer,std::allocator<IntContainer>,btree_seq_narrow_policy> mc;
+		MultipleChecker<IntContainer,std::allocator<IntContainer>,NarrowPrefixPolicy> mcp;
+		vector<IntContainer> vi;
+		int j;
+		vi.resize(600);
+		for(j=0;j<600;j++){
+			vi[j].set(j);
+		}
+		PerformCheck(mc,vi,600000,75,85,95,98,10);
+		PerformCheck(mc,vi,600000,50,95,95,95,10);
+		PerformCheck(mcp,vi,600000,75,85,95,98,10);
+		PerformCheck(mcp,vi,600000,50,95,95,95,10);
+		btree_seq<int,btree_seq_nodes<int,512,1024,unsigned>::L,btree_seq_nodes<int>::M,
+			std::allocator<int>,btree_seq_narrow_policy> a(100000,1);
+		btree_seq<int> b;
+		assert(a.__branch_size()<=512&&a.__children_in_branch()>b.__children_in_branch());
+		assert(a.max_size()==0xFFFFFFFFu&&b.max_size()==static_cast<size_t>(-1));
+		a[77777]=2;
+		assert(a[77776]==1&&a[77777]==2&&a[77778]==1);
+	}
+}
+
+struct TinyPolicy:public btree_seq_default_policy
+{
+	typedef unsigned char counter_type;
+};
+
+struct TinyPrefixPolicy:public TinyPolicy
+{
+	enum {prefix_counts=1};
+};
+
+template <class P> void CheckMaxSize()
+{
+	typedef btree_seq<int,MM,NN,std::allocator<int>,P> Tiny;
+	vector<int> v(300,1);
+	list<int> li(10,2);
+	int pos[10]={0,10,20,30,40,50,60,70,80,90};
+	Tiny a(v.begin(),v.begin()+250),b;
+	assert(a.max_size()==255);
+	try{
+		a.insert(100,li.begin(),li.end());
+		assert(0);
+	}catch(std::length_error &){
+	}
+	assert(a.size()==250);
+	try{
+		a.insert(a.size(),v.begin(),v.begin()+10);
+		assert(0);
+	}catch(std::length_error &){
+	}
+	try{
+		a.fill(0,6,3);
+		assert(0);
+	}catch(std::length_error &){
+	}
+	try{
+		Tiny c(v.begin(),v.end());
+		assert(0);
+	}catch(std::length_error &){
+	}
+	a.__check_consistency();
+	assert(a.size()==250&&std::count(a.begin(),a.end(),1)==250);
+	a.insert_batch(pos,pos+5,v.begin());
+	assert(a.size()==255);
+	try{
+		a.insert(0,7);
+		assert(0);
+	}catch(std::length_error &){
+	}
+	try{
+		a.push_back(7);
+		assert(0);
+	}catch(std::length_error &){
+	}
+	a.erase(250,255);
+	try{
+		a.insert_batch(pos,pos+10,li.begin());
+		assert(0);
+	}catch(std::length_error &){
+	}
+	assert(a.size()>=250&&a.size()<=255);
+	a.__check_consistency();
+	a.erase(100,a.size());
+	b.insert(0,v.begin(),v.begin()+200);
+	try{
+		a.concatenate_right(b);
+		assert(0);
+	}catch(std::length_error &){
+	}
+	try{
+		a.concatenate_left(b);
+		assert(0);
+	}catch(std::length_error &){
+	}
+	assert(a.size()==100&&b.size()==200);
+	a.__check_consistency();
+	b.__check_consistency();
+	{
+		typename Tiny::appender app(a);
+		try{
+			for(int j=0;j<300;j++){
+				app.push_back(5);
+			}
+			assert(0);
+		}catch(std::length_error &){
+		}
+	}
+	assert(a.size()==255&&a[254]==5);
+	a.__check_consistency();
+	#if __cplusplus >= 201103L
+	try{
+		b.parallel_assign(v.begin(),v.end(),2);
+		assert(0);
+	}catch(std::length_error &){
+	}
+	assert(b.size()==0);
+	b.parallel_assign(v.begin(),v.begin()+255,2);
+	assert(b.size()==255);
+	b.__check_consistency();
+	#endif
+}
+
+void MaxSizeTest()
+{
+	TestDescriptor t1("Test of max_size() with 8-bit counters.");
+	{
+		CheckMaxSize<TinyPolicy>();
+		CheckMaxSize<TinyPrefixPolicy>();
+	}
+}
+
+void BasicTest_Finger()
+{
+	TestDescriptor t1("Test of four operations with finger search.");
+	{
+		MultipleChecker<IntContainer,std::allocator<IntContainer>,btree_seq_finger_policy> mc;
+		vector<IntContainer> vi;
+		int j;
+		vi.resize(600);
+		for(j=0;j<600;j++){
+			vi[j].set(j);
+		}
+		PerformCheck(mc,vi,600000,75,85,95,98,10);
+		PerformCheck(mc,vi,600000,50,95,95,95,10);
+	}
+}
+
+void HintTest()
+{
+	TestDescriptor t1("Test of access with hints.");
+	{
+		btree_seq<int,MM,NN> a,b;
+		const btree_seq<int,MM,NN> &ca=a;
+		btree_seq<int,MM,NN>::hint h1,h2;
+		vector<int> va,vb;
+		int j,k,pos=0;
+		for(j=0;j<3000;j++){
+			k=rand()%(j+1);
+			a.insert(k,j);
+			va.insert(va.begin()+k,j);
+			b.insert(0,-j);
+			vb.insert(vb.begin(),-j);
+		}
+		for(j=0;j<20000;j++){
+			pos+=rand()%21-10;
+			pos=(pos<0)?0:(pos>=(int)va.size())?(int)va.size()-1:pos;
+			assert(a.get(pos,h1)==va[pos]);
+			assert(ca.get(pos,h2)==va[pos]);
+			assert(b.get(pos,h2)==vb[pos]);
+			switch(rand()%50){
+			case 0:
+				k=rand()%va.size();
+				a.erase(k,k+1);
+				va.erase(va.begin()+k);
+				break;
+			case 1:
+				k=rand()%(va.size()+1);
+				a.insert(k,-1);
+				va.insert(va.begin()+k,-1);
+				break;
+			case 2:
+				a.swap(b);
+				va.swap(vb);
+				break;
+			case 3:
+				h1.reset();
+				break;
+			case 4:
+				{
+					btree_seq<int,MM,NN> c;
+					k=rand()%(va.size()+1);
+					a.split_right(c,k);
+					a.concatenate_right(c);
+				}
+				break;
+			default:
+				a.get(pos,h1)=j;
+				va[pos]=j;
+			}
+		}
+	}
+}
+
+void GatherScatterTest()
+{
+	TestDescriptor t1("Test of gather/scatter by sorted positions.");
+	{
+		btree_seq<int,MM,NN> a;
+		const btree_seq<int,MM,NN> &ca=a;
+		vector<int> va,pos,res;
+		int j,k,n;
+		for(j=0;j<5000;j++){
+			k=rand()%(j+1);
+			a.insert(k,j);
+			va.insert(va.begin()+k,j);
+		}
+		for(n=1;n<=5000;n*=3){
+			pos.clear();
+			for(j=0;j<n;j++){
+				pos.push_back(rand()%va.size());
+			}
+			sort(pos.begin(),pos.end());
+			res.assign(n+1,-1);
+			assert(ca.gather(pos.begin(),pos.end(),res.begin())==res.begin()+n);
+			for(j=0;j<n;j++){
+				assert(res[j]==va[pos[j]]);
+			}
+			assert(res[n]==-1);
+			for(j=0;j<n;j++){
+				res[j]=-j;
+				va[pos[j]]=-j;
+			}
+			assert(a.scatter(pos.begin(),pos.end(),res.begin())==res.begin()+n);
+			assert(std::equal(va.begin(),va.end(),a.begin()));
+		}
+		//unsorted positions are correct as well
+		for(j=(int)pos.size()-1;j>0;j--){
+			std::swap(pos[j],pos[rand()%(j+1)]);
+		}
+		res.clear();
+		ca.gather(pos.begin(),pos.end(),back_inserter(res));
+		for(j=0;j<(int)pos.size();j++){
+			assert(res[j]==va[pos[j]]);
+		}
+		a.clear();
+		assert(ca.gather(pos.begin(),pos.begin(),res.begin())==res.begin());
+	}
+}
+
 void BasicTest_IntContainer()
 {
 	TestDescriptor t1("Test of four operations with complex structure.");
@@ -557,6 +886,28 @@ void IteratorsTest_Int()
 	}	
 }
 
+void IteratorsTest_Deep()
+{
+	TestDescriptor t1("Test of sequential iterators crossing branches.");
+	{
+		int j,n=20000;
+		vector<int> vi;
+		btree_seq<int,MM,NN> aka;
+		for(j=0;j<n;j++){
+			int p=rand()%(j+1);
+			vi.insert(vi.begin()+p,j);
+			aka.insert(p,j);
+		}
+		assert(std::equal(aka.begin(),aka.end(),vi.begin()));
+		assert(std::equal(aka.rbegin(),aka.rend(),vi.rbegin()));
+		btree_seq<int,MM,NN>::const_iterator it=aka.begin()+n/2;
+		for(j=n/2;j>=0;j-=3){
+			assert(*it==vi[j]);
+			it-=3;
+		}
+	}
+}
+
 void TestFill_Int()
 {
 	TestDescriptor t1("Test with fill functions (iterators being checked).");
@@ -591,6 +942,1162 @@ void TestFill_Int()
 	}	
 }
 
+void BulkLoadTest()
+{
+	TestDescriptor t1("Test of bulk loading (constructors, assign, insert at the ends).");
+	{
+		vector<int> vi;
+		int j,n;
+		for(n=0;n<3000;n=n*3/2+1){
+			SetVec(vi,n,n);
+			btree_seq<int,MM,NN> a(vi.begin(),vi.end());
+			a.__check_consistency();
+			assert(a.size()==vi.size());
+			assert(std::equal(vi.begin(),vi.end(),a.begin()));
+			btree_seq<int,MM,NN> b(a),c(n,7);
+			b.__check_consistency();
+			c.__check_consistency();
+			assert(a==b);
+			assert(c.size()==(size_t)n);
+			b.insert(b.size(),vi.begin(),vi.end());
+			b.insert(0,vi.begin(),vi.end());
+			b.__check_consistency();
+			for(j=0;j<n;j++){
+				assert(b[j]==vi[j]);
+				assert(b[n+j]==vi[j]);
+				assert(b[2*n+j]==vi[j]);
+			}
+			c=b;
+			c.__check_consistency();
+			assert(c==b);
+			c.assign(vi.begin(),vi.end());
+			c.__check_consistency();
+			assert(c==a);
+		}
+		btree_seq<int,MM,NN,std::allocator<int>,btree_seq_prefix_policy> p(vi.begin(),vi.end());
+		p.__check_consistency();
+		p.insert(p.size(),vi.begin(),vi.end());
+		p.__check_consistency();
+		assert(p.size()==2*vi.size());
+		assert(std::equal(vi.begin(),vi.end(),p.begin()+vi.size()));
+	}
+}
+
+void AppenderTest()
+{
+	TestDescriptor t1("Test of appender.");
+	{
+		vector<int> vi;
+		int j,k,n;
+		for(n=0;n<3000;n=n*3/2+1){
+			SetVec(vi,n,n);
+			btree_seq<int,MM,NN> a(vi.begin(),vi.end());
+			btree_seq<int,MM,NN,std::allocator<int>,btree_seq_prefix_policy> p;
+			{
+				btree_seq<int,MM,NN>::appender app(a);
+				btree_seq<int,MM,NN,std::allocator<int>,btree_seq_prefix_policy>::appender pp(p);
+				for(j=0;j<n;j++){
+					app.push_back(-j);
+					pp.push_back(n+j);
+				}
+			}
+			a.__check_consistency();
+			p.__check_consistency();
+			assert(a.size()==2*vi.size());
+			assert(std::equal(vi.begin(),vi.end(),a.begin()));
+			assert(std::equal(vi.begin(),vi.end(),p.begin()));
+			for(j=0;j<n;j++){
+				assert(a[n+j]==-j);
+			}
+		}
+		//flushing in the middle and using the container between the portions
+		btree_seq<int,MM,NN> b;
+		btree_seq<int,MM,NN>::appender app(b);
+		vi.clear();
+		for(k=0;k<50;k++){
+			for(j=rand()%40;j>0;j--){
+				app.push_back(k);
+				vi.push_back(k);
+			}
+			app.flush();
+			b.__check_consistency();
+			assert(b.size()==vi.size());
+			if(k%10==9){
+				b.erase(0,b.size()/2);
+				vi.erase(vi.begin(),vi.begin()+vi.size()/2);
+			}
+			b.push_back(-k);
+			vi.push_back(-k);
+			assert(std::equal(vi.begin(),vi.end(),b.begin()));
+		}
+		app.flush();
+		b.clear();
+		app.flush();
+		for(j=0;j<100;j++){
+			app.push_back(j);
+		}
+		app.flush();
+		b.__check_consistency();
+		assert(b.size()==100&&b[99]==99);
+	}
+}
+
+typedef btree_seq<IntContainer,MM,NN,std::allocator<IntContainer>,btree_seq_cow_policy> CowSeq;
+
+template <class Seq>
+void CowCheck(Seq &a,const vector<int> &v)
+{
+	const Seq &ca=a;
+	a.__check_consistency();
+	assert(a.size()==v.size());
+	typename Seq::const_iterator it=ca.begin();
+	for(size_t j=0;j<v.size();j++,++it){
+		assert(it->get()==v[j]);
+	}
+}
+
+struct CowNegate
+{
+	bool operator()(IntContainer &ic){ic.set(-ic.get());return false;}
+};
+
+void CowTest()
+{
+	TestDescriptor t1("Test of copy-on-write policy.");
+	{
+		const int slots=4;
+		CowSeq a[slots];
+		vector<int> v[slots];
+		vector<IntContainer> ins(20);
+		int j,k,n,s,pos,op,val=0;
+		for(j=0;j<100000;j++){
+			s=rand()%slots;
+			k=rand()%slots;
+			n=v[s].size();
+			pos=n?rand()%(n+1):0;
+			op=rand()%12;
+			if(n>300){
+				op=rand()%2?4:11;
+			}
+			switch(op){
+			case 0://copy
+				a[s]=a[k];
+				v[s]=v[k];
+				break;
+			case 1:{//copy construction
+				CowSeq c(a[k]);
+				a[s].swap(c);
+				v[s]=v[k];
+				break;}
+			case 2://insert one
+				ins[0].set(val);
+				a[s].insert(pos,ins[0]);
+				v[s].insert(v[s].begin()+pos,val++);
+				break;
+			case 3:{//insert range
+				int m=rand()%20;
+				for(int q=0;q<m;q++){
+					ins[q].set(val);
+					v[s].insert(v[s].begin()+pos+q,val++);
+				}
+				a[s].insert(pos,&ins[0],&ins[0]+m);
+				break;}
+			case 4:{//erase range
+				int last=pos+rand()%(n-pos+1);
+				if(rand()%4==0){
+					last=pos+(pos<n);
+				}
+				a[s].erase(pos,last);
+				v[s].erase(v[s].begin()+pos,v[s].begin()+last);
+				break;}
+			case 5://writing through operator[]
+				if(pos<n){
+					a[s][pos].set(val);
+					v[s][pos]=val++;
+				}
+				break;
+			case 6:{//writing through an iterator
+				CowSeq::iterator it=a[s].begin()+pos;
+				for(int q=pos;q<n&&q<pos+30;q++,++it){
+					it->set(val);
+					v[s][q]=val++;
+				}
+				break;}
+			case 7:{//visit
+				CowNegate neg;
+				int last=pos+rand()%(n-pos+1);
+				a[s].visit(pos,last,neg);
+				for(int q=pos;q<last;q++){
+					v[s][q]=-v[s][q];
+				}
+				break;}
+			case 8:{//concatenation of a copy
+				CowSeq c(a[k]);
+				vector<int> w=v[k];
+				if(rand()%2){
+					a[s].concatenate_right(c);
+					v[s].insert(v[s].end(),w.begin(),w.end());
+				}else{
+					a[s].concatenate_left(c);
+					v[s].insert(v[s].begin(),w.begin(),w.end());
+				}
+				assert(c.empty());
+				break;}
+			case 9:{//splitting, the right part goes to another slot
+				if(s!=k){
+					a[s].split_right(a[k],pos);
+					v[k].assign(v[s].begin()+pos,v[s].end());
+					v[s].resize(pos);
+				}
+				break;}
+			case 10:{//appender
+				CowSeq::appender app(a[s]);
+				for(int q=rand()%30;q>0;q--){
+					ins[0].set(val);
+					app.push_back(ins[0]);
+					v[s].push_back(val++);
+				}
+				break;}
+			case 11://clear
+				a[s].clear();
+				v[s].clear();
+				break;
+			}
+			CowCheck(a[s],v[s]);
+			if(j%100==0){
+				for(k=0;k<slots;k++){
+					CowCheck(a[k],v[k]);
+				}
+			}
+		}
+		for(k=0;k<slots;k++){
+			CowCheck(a[k],v[k]);
+		}
+	}
+}
+
+//Erases multiples of mod, throws on the call number thr (if thr>=0).
+struct EraseIfPred
+{
+	int mod,thr,calls;
+	EraseIfPred(int m,int t):mod(m),thr(t),calls(0){}
+	bool operator()(IntContainer &ic)
+	{
+		if(calls++==thr){
+			throw 1;
+		}
+		return ic.get()%mod==0;
+	}
+};
+
+void EraseIfTest()
+{
+	TestDescriptor t1("Test of erase_if.");
+	{
+		CowSeq a,b;
+		vector<int> va,vb,vr;
+		vector<IntContainer> ins(1);
+		int j,k,n,first,last,mod,thr,removed;
+		for(j=0;j<3000;j++){
+			ins[0].set(j);
+			a.push_back(ins[0]);
+			va.push_back(j);
+		}
+		for(j=0;j<300&&va.size();j++){
+			n=va.size();
+			first=rand()%n;
+			last=first+rand()%(n-first+1);
+			mod=1+rand()%(j%3?7:2);
+			thr=(j%5)?-1:rand()%(last-first+1);
+			vr.assign(va.begin(),va.begin()+first);
+			for(k=first;k<last;k++){
+				if((thr>=0&&k-first>=thr)||va[k]%mod){
+					vr.push_back(va[k]);
+				}
+			}
+			vr.insert(vr.end(),va.begin()+last,va.end());
+			if(j%2){
+				b=a;
+				vb=va;
+			}
+			try{
+				removed=a.erase_if(first,last,EraseIfPred(mod,thr));
+				assert(thr<0||thr==last-first);
+				assert(removed==n-(int)vr.size());
+			}catch(int){
+				assert(thr>=0&&thr<last-first);
+			}
+			va.swap(vr);
+			CowCheck(a,va);
+			if(j%2){
+				CowCheck(b,vb);
+			}
+			if(va.size()<500){
+				for(k=0;k<1000;k++){
+					ins[0].set(k*7+1);
+					a.push_back(ins[0]);
+					va.push_back(k*7+1);
+				}
+			}
+		}
+		assert(a.erase_if(0,0,EraseIfPred(1,-1))==0);
+		assert(a.erase_if(0,a.size(),EraseIfPred(1,-1))==va.size());
+		assert(a.empty());
+		//the root is a single leaf
+		va.clear();
+		for(j=0;j<3;j++){
+			ins[0].set(j);
+			a.push_back(ins[0]);
+			va.push_back(j);
+		}
+		assert(a.erase_if(0,3,EraseIfPred(2,-1))==2);
+		va.assign(1,1);
+		CowCheck(a,va);
+	}
+}
+
+//Inserting the values one by one from the back gives the same result as insert_batch.
+void InsertOneByOne(vector<int> &v,const vector<int> &pos,int val,int m)
+{
+	for(int k=m-1;k>=0;k--){
+		v.insert(v.begin()+pos[k],val+k);
+	}
+}
+
+template <class P>
+void CheckInsertBatch()
+{
+	typedef btree_seq<IntContainer,MM,NN,std::allocator<IntContainer>,P> Seq;
+	Seq a,b;
+	vector<int> va,vb,vr,pos;
+	vector<IntContainer> vals;
+	int j,k,n,m,t,val=0;
+	for(j=0;j<400;j++){
+		n=va.size();
+		m=(j%4)?rand()%(j%3?10:300):(n?n*(rand()%3):50);
+		pos.clear();
+		vals.resize(m);
+		for(k=0;k<m;k++){
+			pos.push_back(n?rand()%(n+1):0);
+		}
+		if(j%5==0){
+			for(k=0;k<m;k++){
+				pos[k]=n/2;
+			}
+		}
+		sort(pos.begin(),pos.end());
+		vr.clear();
+		for(k=0;k<m;k++){
+			vals[k].set(val+k);
+		}
+		vb=va;
+		if(j%7==3&&m!=0){
+			//the copy of value t throws, a prefix of the batch stays inserted
+			t=rand()%m;
+			vals[t].set(-100);
+			try{
+				a.insert_batch(pos.begin(),pos.end(),vals.begin());
+				assert(0);
+			}catch(const char*){
+			}
+			vals[t].set(val+t);
+			m=a.size()-n;
+			assert(m<=t);
+		}else{
+			if(j%2){
+				b=a;
+				vr=va;
+			}
+			assert(a.insert_batch(pos.begin(),pos.end(),vals.begin())==vals.end());
+		}
+		InsertOneByOne(vb,pos,val,m);
+		val+=m;
+		va.swap(vb);
+		CowCheck(a,va);
+		if(!vr.empty()){
+			CowCheck(b,vr);
+		}
+		if(va.size()>5000){
+			a.erase(0,4000);
+			va.erase(va.begin(),va.begin()+4000);
+		}
+	}
+	a.clear();
+	assert(a.insert_batch(pos.begin(),pos.begin(),vals.begin())==vals.begin());
+	assert(a.empty());
+}
+
+void InsertBatchTest()
+{
+	TestDescriptor t1("Test of insert_batch.");
+	{
+		CheckInsertBatch<btree_seq_default_policy>();
+		CheckInsertBatch<btree_seq_prefix_policy>();
+		CheckInsertBatch<btree_seq_narrow_policy>();
+		CheckInsertBatch<btree_seq_finger_policy>();
+		CheckInsertBatch<btree_seq_cow_policy>();
+	}
+}
+
+//The structure of the tree without the addresses of nodes.
+template <class Seq>
+string TreeShape(Seq &a)
+{
+	std::ostringstream os;
+	a.__output(os);
+	string s=os.str(),res;
+	for(size_t j=0;j<s.size();j++){
+		if(s.compare(j,2,"0x")==0){
+			for(j+=2;j<s.size()&&isxdigit(s[j]);j++){
+			}
+		}
+		res+=s[j];
+	}
+	return res;
+}
+
+//Counts the calls of allocate.
+int allocations=0;
+template<class T> struct CountingAllocator:public std::allocator<T>
+{
+	template<class U> struct rebind{typedef CountingAllocator<U> other;};
+	CountingAllocator(){}
+	template<class U> CountingAllocator(const CountingAllocator<U>&){}
+	T *allocate(size_t n){allocations++;return std::allocator<T>::allocate(n);}
+};
+
+void CowEraseTest()
+{
+	TestDescriptor t1("Test of erasing from and visiting a shared tree.");
+	{
+		typedef btree_seq<int,MM,NN,CountingAllocator<int>,btree_seq_cow_policy> CountingCowSeq;
+		CountingCowSeq a;
+		vector<int> v;
+		int j,k,n,first,last,copy_allocations;
+		for(k=0;k<10000;k++){
+			v.push_back(k);
+		}
+		allocations=0;
+		a.assign(v.begin(),v.end());
+		copy_allocations=allocations;
+		for(j=0;j<100;j++){
+			CountingCowSeq b(a);
+			n=a.size();
+			first=rand()%(n/10);
+			last=n-rand()%(n/10);
+			//only the paths to both ends are copied, not the erased middle
+			allocations=0;
+			b.erase(first,last);
+			assert(allocations*10<copy_allocations);
+			b.__check_consistency();
+			a.__check_consistency();
+			assert(a.size()==v.size()&&std::equal(v.begin(),v.end(),a.begin()));
+			assert(b.size()==size_t(n-(last-first)));
+			assert(std::equal(v.begin(),v.begin()+first,b.begin()));
+			assert(std::equal(v.begin()+last,v.end(),b.begin()+first));
+			//the const visit leaves the nodes shared
+			CountingCowSeq c(a);
+			const CountingCowSeq &ca=a,&cc=c;
+			SumVisitor sv;
+			allocations=0;
+			cc.visit(first,last,sv);
+			assert(allocations==0);
+			assert(&ca[first]==&cc[first]);
+			assert(sv.get_sum()==SumIters(v.begin()+first,v.begin()+last));
+		}
+	}
+}
+
+void ReserveShrinkTest()
+{
+	TestDescriptor t1("Test of reserve and shrink_to_fit.");
+	{
+		btree_seq<int,MM,NN,CountingAllocator<int> > a,b;
+		CowSeq c,d;
+		vector<int> va,vals,pos;
+		vector<IntContainer> ins(1);
+		int j,k,n,m,p,mode,shrunk;
+		for(j=0;j<200;j++){
+			//growing up to the reserved size does not allocate, whatever the inserts are
+			n=va.size()+rand()%3000;
+			mode=rand()%6;
+			a.reserve(n);
+			allocations=0;
+			while((int)va.size()<n){
+				p=(mode==1)?0:(mode==2)?va.size():(mode==3)?va.size()/2:rand()%(va.size()+1);
+				m=(mode<4)?1:1+rand()%(n-va.size());
+				if(mode==4&&rand()%2){
+					p=(rand()%2)?0:va.size();
+				}
+				vals.resize(m);
+				for(k=0;k<m;k++){
+					vals[k]=j*10000+va.size()+k;
+				}
+				if(mode==5){
+					pos.resize(m);
+					for(k=0;k<m;k++){
+						pos[k]=rand()%(va.size()+1);
+					}
+					std::sort(pos.begin(),pos.end());
+					a.insert_batch(pos.begin(),pos.end(),vals.begin());
+					InsertOneByOne(va,pos,vals[0],m);
+				}else{
+					a.insert(p,vals.begin(),vals.end());
+					va.insert(va.begin()+p,vals.begin(),vals.end());
+				}
+			}
+			assert(allocations==0);
+			a.__check_consistency();
+			assert(a.size()==va.size()&&std::equal(va.begin(),va.end(),a.begin()));
+			//thin leaves are left, shrink_to_fit repacks them into as few as assign
+			m=rand()%(va.size()+1);
+			for(k=0;k<m;k++){
+				p=rand()%va.size();
+				a.erase(p,p+1);
+				va.erase(va.begin()+p);
+			}
+			btree_seq<int,MM,NN,CountingAllocator<int> > e(a);
+			allocations=0;
+			a.shrink_to_fit();
+			shrunk=allocations;
+			a.__check_consistency();
+			assert(a.size()==va.size()&&std::equal(va.begin(),va.end(),a.begin()));
+			b.assign(va.begin(),va.end());
+			assert(TreeShape(a)==TreeShape(b));
+			//the emptied leaves are used again, compact allocates all the new ones
+			allocations=0;
+			e.compact();
+			assert(va.empty()||TreeShape(e)==TreeShape(b));
+			assert(va.size()<2*NN||shrunk<allocations);
+			if(rand()%4==0){
+				a.clear();
+				va.clear();
+			}
+		}
+		a.clear();
+		a.shrink_to_fit();
+		assert(a.empty());
+		//shared nodes are copied, the other container does not change
+		for(j=0;j<3000;j++){
+			ins[0].set(j);
+			c.insert(rand()%(j+1),ins[0]);
+		}
+		d=c;
+		c.erase(1000,2000);
+		c.shrink_to_fit();
+		c.__check_consistency();
+		d.__check_consistency();
+		assert(c.size()==2000&&d.size()==3000);
+		for(j=0;j<1000;j++){
+			assert(d[j].get()==c[j].get()&&d[j+2000].get()==c[j+1000].get());
+		}
+	}
+}
+
+void CompactTest()
+{
+	TestDescriptor t1("Test of compact.");
+	{
+		btree_seq<int,MM,NN> a,b;
+		CowSeq c,d;
+		vector<int> va;
+		vector<IntContainer> ins(1);
+		size_t pos;
+		int j,k,n;
+		for(j=0;j<10;j++){
+			for(k=0;k<3000;k++){
+				n=rand()%(va.size()+1);
+				a.insert(n,k);
+				va.insert(va.begin()+n,k);
+			}
+			for(k=0;k<1000;k++){
+				n=rand()%va.size();
+				a.erase(n,n+1);
+				va.erase(va.begin()+n);
+			}
+			switch(j%3){
+			case 0://the leaves are full and follow each other in memory
+				a.compact();
+				b.assign(va.begin(),va.end());
+				assert(TreeShape(a)==TreeShape(b));
+				for(k=1;k<(int)a.size();k++){
+					assert(&a[k-1]<&a[k]);
+				}
+				break;
+			case 1:
+				a.compact(NN/2);
+				break;
+			default://a few leaves at a time, changing the sequence between the steps
+				for(pos=0,k=0;pos<a.size();pos=a.compact(pos,3),k++){
+					if(k%64==0){
+						a.__check_consistency();
+					}
+					n=rand()%(va.size()+1);
+					a.insert(n,-j);
+					va.insert(va.begin()+n,-j);
+				}
+				break;
+			}
+			a.__check_consistency();
+			assert(a.size()==va.size()&&std::equal(va.begin(),va.end(),a.begin()));
+		}
+		//after a pass of steps no branch is left out, another pass moves nothing
+		vector<const int*> addr;
+		for(j=0;j<10;j++){
+			for(k=0;k<3000;k++){
+				n=rand()%(va.size()+1);
+				a.insert(n,k);
+				va.insert(va.begin()+n,k);
+			}
+			for(k=0;k<2000;k++){
+				n=rand()%va.size();
+				a.erase(n,n+1);
+				va.erase(va.begin()+n);
+			}
+			for(pos=0;pos<a.size();pos=a.compact(pos,1+j%4)){
+			}
+			a.__check_consistency();
+			assert(a.size()==va.size()&&std::equal(va.begin(),va.end(),a.begin()));
+			addr.clear();
+			for(k=0;k<(int)a.size();k++){
+				addr.push_back(&a[k]);
+			}
+			for(pos=0;pos<a.size();pos=a.compact(pos,1+j%4)){
+			}
+			for(k=0;k<(int)a.size();k++){
+				assert(addr[k]==&a[k]);
+			}
+		}
+		a.clear();
+		a.compact();
+		assert(a.compact(0,10)==0);
+		//shared nodes are copied, the other container does not change
+		for(j=0;j<3000;j++){
+			ins[0].set(j);
+			c.insert(rand()%(j+1),ins[0]);
+		}
+		d=c;
+		for(pos=0;pos<1500;pos=c.compact(pos,5)){
+		}
+		c.__check_consistency();
+		c.compact(NN/2+1);
+		c.__check_consistency();
+		d.__check_consistency();
+		assert(c.size()==3000&&d.size()==3000);
+		for(j=0;j<3000;j++){
+			assert(d[j].get()==c[j].get());
+		}
+	}
+}
+
+typedef btree_seq<int,MM,NN,btree_seq_pool_allocator<int> > PoolSeq;
+
+void PoolAllocatorTest()
+{
+	TestDescriptor t1("Test of the node pool allocator.");
+	{
+		btree_seq_node_pool pool(1024);
+		btree_seq_pool_allocator<int> alloc(pool);
+		vector<PoolSeq> seqs(20,PoolSeq(alloc));
+		vector<vector<int> > vs(seqs.size());
+		btree_seq<int,MM,NN,btree_seq_pool_allocator<int>,btree_seq_aligned_policy> al(alloc);
+		PoolSeq other;
+		size_t j,k,n,mem=0;
+		unsigned int place;
+		assert(seqs[0].get_allocator()==alloc&&other.get_allocator()!=alloc);
+		for(int round=0;round<3;round++){
+			//the same changes in each round
+			for(k=0,place=2;k<20000;k++){
+				next_rand(place);
+				j=place%seqs.size();
+				next_rand(place);
+				n=place;
+				next_rand(place);
+				if(n%3!=0||vs[j].empty()){
+					n=place%(vs[j].size()+1);
+					seqs[j].insert(n,(int)k);
+					vs[j].insert(vs[j].begin()+n,(int)k);
+				}else{
+					n=place%vs[j].size();
+					seqs[j].erase(n,n+1);
+					vs[j].erase(vs[j].begin()+n);
+				}
+			}
+			//the containers of one pool exchange nodes
+			seqs[0].concatenate_right(seqs[1]);
+			vs[0].insert(vs[0].end(),vs[1].begin(),vs[1].end());
+			vs[1].clear();
+			seqs[2].swap(seqs[3]);
+			vs[2].swap(vs[3]);
+			for(j=0;j<seqs.size();j++){
+				seqs[j].__check_consistency();
+				assert(seqs[j].size()==vs[j].size()&&std::equal(vs[j].begin(),vs[j].end(),seqs[j].begin()));
+			}
+			al.assign(vs[0].begin(),vs[0].end());
+			al.__check_consistency();
+			assert(std::equal(vs[0].begin(),vs[0].end(),al.begin()));
+			//the freed nodes are taken again, no new slabs are needed
+			for(j=0;j<seqs.size();j++){
+				seqs[j].clear();
+				vs[j].clear();
+			}
+			al.clear();
+			if(round==0){
+				mem=pool.memory();
+				assert(mem>0);
+			}else{
+				assert(pool.memory()==mem);
+			}
+		}
+		other.assign(1000,5);
+		assert(other.get_allocator().get_pool().memory()>0);
+		//slabs of huge pages
+		btree_seq_node_pool huge(1,true);
+		PoolSeq h((btree_seq_pool_allocator<int>(huge)));
+		vector<int> vh(100000);
+		for(j=0;j<vh.size();j++){
+			vh[j]=(int)j;
+		}
+		h.insert(0,vh.begin(),vh.end());
+		h.erase(1000,2000);
+		vh.erase(vh.begin()+1000,vh.begin()+2000);
+		h.__check_consistency();
+		assert(h.size()==vh.size()&&std::equal(vh.begin(),vh.end(),h.begin()));
+		assert(huge.memory()>0&&huge.memory()%(2*1024*1024)==0);
+	}
+}
+
+#if __cplusplus >= 201103L
+typedef btree_seq<int,MM,NN,std::allocator<int>,btree_seq_mvcc_policy> MvccSeq;
+
+//Readers check, that every snapshot is sorted and does not change.
+void MvccReader(const MvccSeq *master,std::atomic<bool> *stop,std::atomic<int> *checked)
+{
+	while(!stop->load()){
+		MvccSeq::snapshot_view s=master->snapshot(),s2(s);
+		long long sum=0,sum2=0;
+		int prev=-1;
+		for(MvccSeq::const_iterator it=s.begin();it!=s.end();++it){
+			assert(*it>=prev);
+			prev=*it;
+			sum+=*it;
+		}
+		for(size_t j=0;j<s2.size();j+=7){
+			sum2+=s2[j]-s[j];
+		}
+		assert(sum2==0);
+		sum2=0;
+		for(size_t j=0;j<s.size();j++){
+			sum2+=s.at(j);
+		}
+		assert(sum==sum2);
+		(*checked)++;
+	}
+}
+
+void MvccTest()
+{
+	TestDescriptor t1("Test of snapshots with concurrent readers.");
+	{
+		MvccSeq a;
+		vector<int> va;
+		int j,k,val;
+		assert(a.snapshot().empty());
+		for(j=0;j<1000;j++){
+			a.push_back(j);
+			va.push_back(j);
+		}
+		a.publish();
+		MvccSeq::snapshot_view s=a.snapshot();
+		for(j=0;j<1000;j++){
+			k=rand()%a.size();
+			a.erase(k,k+1);
+			a.insert(rand()%a.size(),-j);
+			a[rand()%a.size()]=j;
+		}
+		a.__check_consistency();
+		assert(std::equal(va.begin(),va.end(),s.begin()));
+		a.publish();
+		assert(std::equal(a.begin(),a.end(),a.snapshot().begin()));
+		a.clear();
+		a.publish();
+		assert(a.snapshot().empty()&&(s.size()==va.size()));
+		//the published version goes with the nodes
+		{
+			MvccSeq b(va.begin(),va.end());
+			b.publish();
+			a.swap(b);
+			assert(b.snapshot().empty()&&std::equal(va.begin(),va.end(),a.snapshot().begin()));
+			MvccSeq c(std::move(a));
+			assert(a.empty()&&a.snapshot().empty()&&c.snapshot().size()==va.size());
+			b=std::move(c);
+			assert(c.snapshot().empty()&&std::equal(va.begin(),va.end(),b.snapshot().begin()));
+		}
+		//one writer keeps the sequence sorted, readers check the snapshots
+		std::atomic<bool> stop(false);
+		std::atomic<int> checked(0);
+		vector<std::thread> readers;
+		for(j=0;j<3;j++){
+			readers.push_back(std::thread(MvccReader,&a,&stop,&checked));
+		}
+		for(j=0;j<20000;j++){
+			if((a.size()<500)||(rand()%2)){
+				val=rand()%10000;
+				k=std::upper_bound(a.begin(),a.end(),val)-a.begin();
+				a.insert(k,val);
+			}else{
+				k=rand()%(a.size()-2);
+				a.erase(k,k+1+rand()%3);
+			}
+			if(j%10==0){
+				a.publish();
+			}
+		}
+		stop.store(true);
+		for(j=0;j<3;j++){
+			readers[j].join();
+		}
+		a.__check_consistency();
+		assert(std::is_sorted(a.begin(),a.end()));
+		assert(checked.load()>0);
+	}
+}
+
+void ParallelAssignTest()
+{
+	TestDescriptor t1("Test of parallel_assign.");
+	{
+		//the copy constructor of IntContainer counts copies, it is not thread safe
+		btree_seq<int,MM,NN> a,b;
+		vector<int> vi(3000);
+		unsigned threads[]={0,1,2,3,7,100};
+		int j,k,t,sizes[]={0,1,3,4,5,17,64,65,1000,3000};
+		for(j=0;j<3000;j++){
+			vi[j]=j;
+		}
+		for(k=0;k<10;k++){
+			a.assign(vi.begin(),vi.begin()+sizes[k]);
+			for(t=0;t<6;t++){
+				b.parallel_assign(vi.begin(),vi.begin()+sizes[k],threads[t]);
+				b.__check_consistency();
+				assert(std::equal(vi.begin(),vi.begin()+sizes[k],b.begin())&&(int)b.size()==sizes[k]);
+				assert(sizes[k]==0||TreeShape(a)==TreeShape(b));
+			}
+		}
+	}
+}
+
+typedef btree_seq<int,MM,NN,btree_seq_thread_cache_allocator<int> > CachedSeq;
+
+//Each thread changes its own containers; the one given is destroyed by the thread.
+void CacheWorker(unsigned seed,CachedSeq *given,std::atomic<int> *failed)
+{
+	CachedSeq a;
+	vector<int> va;
+	unsigned place=seed;
+	int j,n;
+	for(int round=0;round<5;round++){
+		for(j=0;j<4000;j++){
+			next_rand(place);
+			if(place%4!=0||va.empty()){
+				n=place%(va.size()+1);
+				a.insert(n,j);
+				va.insert(va.begin()+n,j);
+			}else{
+				n=place%va.size();
+				a.erase(n,n+1);
+				va.erase(va.begin()+n);
+			}
+		}
+		a.__check_consistency();
+		if(a.size()!=va.size()||!std::equal(va.begin(),va.end(),a.begin())){
+			failed->fetch_add(1);
+		}
+		if(round%2==1){
+			a.clear();
+			va.clear();
+		}
+	}
+	given->clear();
+	CachedSeq(a).swap(*given);
+}
+
+void ThreadCacheTest()
+{
+	TestDescriptor t1("Test of the thread caches of nodes.");
+	{
+		vector<CachedSeq> given(4);
+		vector<std::thread> threads;
+		std::atomic<int> failed(0);
+		size_t j;
+		for(j=0;j<given.size();j++){
+			given[j].assign(1000,(int)j);
+		}
+		for(j=0;j<given.size();j++){
+			threads.push_back(std::thread(CacheWorker,(unsigned)j+2,&given[j],&failed));
+		}
+		for(j=0;j<threads.size();j++){
+			threads[j].join();
+		}
+		assert(failed.load()==0);
+		//the nodes allocated by the exited threads are freed here
+		for(j=0;j<given.size();j++){
+			given[j].__check_consistency();
+			assert(!given[j].empty());
+			given[j].clear();
+		}
+	}
+}
+
+//Moving and swapping containers with the allocators of different pools.
+void AllocatorMoveTest()
+{
+	TestDescriptor t1("Test of moving and swapping with stateful allocators.");
+	{
+		btree_seq_node_pool pool1,pool2;
+		btree_seq_pool_allocator<int> alloc1(pool1),alloc2(pool2);
+		vector<int> v1(1000),v2(500);
+		size_t j;
+		for(j=0;j<v1.size();j++){
+			v1[j]=(int)j;
+		}
+		for(j=0;j<v2.size();j++){
+			v2[j]=-(int)j;
+		}
+		PoolSeq a(v1.begin(),v1.end(),alloc1),b(v2.begin(),v2.end(),alloc2);
+		size_t mem1=pool1.memory(),mem2=pool2.memory();
+		const int *first=&a[0];
+		//the nodes are taken with their pool, nothing is allocated
+		PoolSeq c(std::move(a));
+		assert(a.empty()&&&c[0]==first&&c.get_allocator()==alloc1);
+		b=std::move(c);
+		assert(c.empty()&&&b[0]==first&&b.get_allocator()==alloc1);
+		assert(c.get_allocator()==alloc2);
+		c.assign(v2.begin(),v2.end());
+		b.swap(c);
+		assert(b.get_allocator()==alloc2&&c.get_allocator()==alloc1&&&c[0]==first);
+		assert(std::equal(v1.begin(),v1.end(),c.begin())&&std::equal(v2.begin(),v2.end(),b.begin()));
+		//with another allocator given, the elements are moved into new nodes
+		PoolSeq d(std::move(c),alloc2);
+		assert(c.empty()&&d.get_allocator()==alloc2&&std::equal(v1.begin(),v1.end(),d.begin()));
+		d.__check_consistency();
+		assert(pool1.memory()==mem1&&pool2.memory()>=mem2);
+#ifdef __BTREE_SEQ_PMR
+		typedef btree_seq<int,MM,NN,std::pmr::polymorphic_allocator<int> > PmrSeq;
+		std::pmr::monotonic_buffer_resource arena1,arena2;
+		PmrSeq e(v1.begin(),v1.end(),&arena1),f(v2.begin(),v2.end(),&arena2),g(&arena1);
+		first=&e[0];
+		//the resource does not propagate: equal ones exchange the nodes
+		g=std::move(e);
+		assert(e.empty()&&&g[0]==first);
+		//different ones keep their nodes, the elements are moved
+		f.swap(g);
+		assert(f.get_allocator().resource()==&arena2&&g.get_allocator().resource()==&arena1);
+		assert(std::equal(v1.begin(),v1.end(),f.begin())&&std::equal(v2.begin(),v2.end(),g.begin()));
+		e=std::move(f);
+		assert(f.empty()&&e.get_allocator().resource()==&arena1&&std::equal(v1.begin(),v1.end(),e.begin()));
+		e.__check_consistency();
+		f.__check_consistency();
+		g.__check_consistency();
+		//a view with another resource gets the elements in its own nodes
+		PmrSeq::frozen_view view;
+		e.freeze(view);
+		assert(e.empty()&&view.size()==v1.size()&&view[777]==777);
+		f.thaw(view);
+		assert(view.empty()&&f.get_allocator().resource()==&arena2&&std::equal(v1.begin(),v1.end(),f.begin()));
+		f.__check_consistency();
+		//if a copy throws, the swap leaves both containers as they were
+		typedef btree_seq<IntContainer,MM,NN,std::pmr::polymorphic_allocator<IntContainer> > PmrInts;
+		PmrInts h(&arena1),k(&arena2);
+		IntContainer ic;
+		for(j=0;j<300;j++){
+			ic.set((int)j);
+			h.push_back(ic);
+			k.push_back(ic);
+		}
+		k[150].set(-100);
+		try{
+			h.swap(k);
+			assert(0);
+		}catch(const char*){
+		}
+		h.__check_consistency();
+		k.__check_consistency();
+		assert(h.size()==300&&k.size()==300&&h[150].get()==150&&k[150].get()==-100);
+		assert(h.get_allocator().resource()==&arena1&&k.get_allocator().resource()==&arena2);
+		k[150].set(150);
+		//copy-on-write shares the nodes only between equal allocators
+		typedef btree_seq<int,MM,NN,std::pmr::polymorphic_allocator<int>,btree_seq_cow_policy> PmrCowSeq;
+		PmrCowSeq m(v1.begin(),v1.end(),&arena1),n(&arena1),p(&arena2);
+		const PmrCowSeq &cm=m,&cn=n,&cp=p;
+		n=m;
+		p=m;
+		assert(&cn[500]==&cm[500]&&&cp[500]!=&cm[500]);
+		assert(p.get_allocator().resource()==&arena2&&std::equal(v1.begin(),v1.end(),p.begin()));
+		m.clear();
+		n.clear();
+		p.__check_consistency();
+#endif
+	}
+}
+
+//Allocator with only the interface required since C++11, without construct and destroy.
+template<class T> struct MinimalAllocator
+{
+	typedef T value_type;
+	MinimalAllocator(){}
+	template<class U> MinimalAllocator(const MinimalAllocator<U> &){}
+	T *allocate(size_t n){return static_cast<T*>(::operator new(n*sizeof(T)));}
+	void deallocate(T *p,size_t){::operator delete(p);}
+	template<class U> bool operator==(const MinimalAllocator<U> &)const{return true;}
+	template<class U> bool operator!=(const MinimalAllocator<U> &)const{return false;}
+};
+
+void MinimalAllocatorTest()
+{
+	TestDescriptor t1("Test of an allocator with the minimal interface.");
+	{
+		typedef btree_seq<IntContainer,MM,NN,MinimalAllocator<IntContainer> > MinimalSeq;
+		MinimalSeq a;
+		vector<int> va;
+		vector<IntContainer> vals(10);
+		int j,k,n,pos[10];
+		for(j=0;j<2000;j++){
+			n=rand()%(va.size()+1);
+			switch(j%4){
+			case 0:
+				vals[0].set(j);
+				a.insert(n,vals[0]);
+				va.insert(va.begin()+n,j);
+				break;
+			case 1:
+				a.emplace(n);
+				a[n].set(j);
+				va.insert(va.begin()+n,j);
+				break;
+			case 2:
+				for(k=0;k<10;k++){
+					pos[k]=n;
+					vals[k].set(j+k);
+				}
+				a.insert_batch(pos,pos+10,vals.begin());
+				for(k=9;k>=0;k--){
+					va.insert(va.begin()+n,j+k);
+				}
+				break;
+			default:
+				a.erase(n/2,n);
+				va.erase(va.begin()+n/2,va.begin()+n);
+			}
+		}
+		{
+			MinimalSeq::appender app(a);
+			for(j=0;j<100;j++){
+				vals[0].set(j);
+				app.push_back(vals[0]);
+				app.emplace_back();
+				va.push_back(j);
+				va.push_back(-1);
+			}
+		}
+		MinimalSeq b(a);
+		CowCheck(a,va);
+		CowCheck(b,va);
+	}
+}
+#else
+void MvccTest(){}
+void ParallelAssignTest(){}
+void ThreadCacheTest(){}
+void AllocatorMoveTest(){}
+void MinimalAllocatorTest(){}
+#endif
+
+#ifdef __BTREE_SEQ_PMR
+//Monotonic arena counting the calls of deallocate, which frees nothing.
+struct CountingArena:public std::pmr::monotonic_buffer_resource
+{
+	int deallocations;
+	CountingArena():deallocations(0){}
+	void do_deallocate(void *p,size_t bytes,size_t align)
+	{
+		deallocations++;
+		std::pmr::monotonic_buffer_resource::do_deallocate(p,bytes,align);
+	}
+};
+
+void PmrTest()
+{
+	TestDescriptor t1("Test of std::pmr allocators.");
+	{
+		typedef btree_seq<int,MM,NN,std::pmr::polymorphic_allocator<int> > PmrSeq;
+		typedef btree_seq<std::pmr::string,MM,NN,std::pmr::polymorphic_allocator<std::pmr::string> > PmrStrings;
+		CountingArena arena;
+		//everything is taken from the arena, nothing from the default resource
+		std::pmr::memory_resource *old=std::pmr::set_default_resource(std::pmr::null_memory_resource());
+		{
+			PmrSeq a(&arena);
+			vector<int> va;
+			int j,n;
+			for(j=0;j<3000;j++){
+				n=rand()%(va.size()+1);
+				a.insert(n,j);
+				va.insert(va.begin()+n,j);
+				if(j%3==0){
+					n=rand()%va.size();
+					a.erase(n,n+1);
+					va.erase(va.begin()+n);
+				}
+			}
+			a.__check_consistency();
+			assert(a.get_allocator().resource()==&arena);
+			assert(a.size()==va.size()&&std::equal(va.begin(),va.end(),a.begin()));
+			//the elements are given the resource of the container
+			PmrStrings s(&arena);
+			for(j=0;j<100;j++){
+				s.insert(rand()%(s.size()+1),std::pmr::string(40,'a'+j%26,&arena));
+			}
+			s.erase(10,20);
+			s.__check_consistency();
+			for(j=0;j<(int)s.size();j++){
+				assert(s[j].get_allocator().resource()==&arena&&s[j].size()==40);
+			}
+			//a copy takes the default resource, as the standard containers do
+			std::pmr::set_default_resource(std::pmr::new_delete_resource());
+			{
+				PmrSeq e(a);
+				e.__check_consistency();
+				assert(e.get_allocator().resource()==std::pmr::new_delete_resource());
+				assert(e.size()==va.size()&&std::equal(va.begin(),va.end(),e.begin()));
+			}
+			std::pmr::set_default_resource(std::pmr::null_memory_resource());
+			//the strings are destroyed one by one (each frees its buffer), the nodes
+			//are left to the arena, the ints are dropped with their nodes
+			n=arena.deallocations+s.size();
+			s.clear();
+			assert(arena.deallocations==n);
+			a.clear();
+			assert(arena.deallocations==n&&a.empty());
+			a.assign(va.begin(),va.end());
+			//shared nodes are released one by one, even in an arena
+			typedef btree_seq<int,MM,NN,std::pmr::polymorphic_allocator<int>,btree_seq_cow_policy> PmrCowSeq;
+			PmrCowSeq c(va.begin(),va.end(),&arena),d(&arena);
+			d=c;
+			c.clear();
+			d[0]=-1;
+			d.__check_consistency();
+			assert(c.empty()&&d.size()==va.size()&&d[0]==-1&&std::equal(va.begin()+1,va.end(),d.begin()+1));
+			n=arena.deallocations;
+			d.clear();
+			assert(arena.deallocations>n&&d.empty());
+		}
+		std::pmr::set_default_resource(old);
+	}
+}
+#else
+void PmrTest(){}
+#endif
+
 void TestCopyExceptions()
 {
 	TestDescriptor t1("Test for exception handling. When objects are copied, they throw exceptions.");
@@ -680,6 +2187,27 @@ public:
 	typedef btree_seq<IntContainer,4,4> container;
 	static void SetProb(double){};
 };
+
+class PrefixTest
+{
+public:
+	typedef btree_seq<IntContainer,4,4,std::allocator<IntContainer>,btree_seq_prefix_policy> container;
+	static void SetProb(double){};
+};
+
+class PrefetchTest
+{
+public:
+	typedef btree_seq<IntContainer,4,4,std::allocator<IntContainer>,btree_seq_prefetch_policy> container;
+	static void SetProb(double){};
+};
+
+class AlignedTest
+{
+public:
+	typedef btree_seq<IntContainer,4,4,std::allocator<IntContainer>,btree_seq_aligned_policy> container;
+	static void SetProb(double){};
+};
 	
 template <typename TestType>
 void AttachTest()
@@ -787,6 +2315,56 @@ void LeftTests()
 	}
 }
 
+template <typename Container>
+void FreezeCheck(int n)
+{
+	Container a;
+	typename Container::frozen_view v;
+	vector<int> vi;
+	int j;
+	for(j=0;j<n;j++){
+		int p=rand()%(j+1);
+		a.insert(a.begin()+p,j);
+		vi.insert(vi.begin()+p,j);
+	}
+	a.freeze(v);
+	assert(a.empty()&&(v.size()==vi.size()));
+	for(j=0;j<n;j++){
+		assert((v[j]==vi[j])&&(v.at(j)==vi[j]));
+	}
+	assert(std::equal(v.begin(),v.end(),vi.begin()));
+	try{
+		v.at(n);
+		assert(0);
+	}catch(std::out_of_range &){
+	}
+	a.push_back(-1);
+	a.thaw(v);
+	assert(v.empty()&&(a.size()==vi.size()));
+	a.__check_consistency();
+	a.insert(a.begin(),-1);
+	vi.insert(vi.begin(),-1);
+	assert(std::equal(a.begin(),a.end(),vi.begin()));
+}
+
+void FreezeTest()
+{
+	TestDescriptor t1("Freeze/thaw test.");
+	{
+		int n;
+		for(n=0;n<3000;n=n*3+1){
+			FreezeCheck<btree_seq<int,MM,NN> >(n);
+			FreezeCheck<btree_seq<int,MM,NN,std::allocator<int>,btree_seq_prefix_policy> >(n);
+		}
+		FreezeCheck<btree_seq<int> >(100000);
+		btree_seq<int,MM,NN> a(10,1),b(20,2);
+		btree_seq<int,MM,NN>::frozen_view v;
+		a.freeze(v);
+		b.freeze(v);
+		assert((v.size()==20)&&(v[19]==2)&&a.empty()&&b.empty());
+	}
+}
+
 void ResizeTest()
 {
 	TestDescriptor t1("Resize test.");
@@ -943,6 +2521,33 @@ void RelationsTest()
 	}
 }
 
+struct S200{
+	char c[200];
+};
+
+void NodeSizeTest()
+{
+	TestDescriptor t1("Node sizes from byte budgets test.");
+	{
+		btree_seq<int> ai;
+		btree_seq<char> ac;
+		btree_seq<S200> as;
+		assert(ai.__leaf_size()<=1024&&ai.__branch_size()<=512);
+		assert(ac.__leaf_size()<=1024&&ac.__elements_in_leaf()>ai.__elements_in_leaf());
+		assert(as.__leaf_size()<=1024&&as.__children_in_branch()==ai.__children_in_branch());
+		assert(((int)btree_seq_nodes<int,4096,4096>::L>(int)btree_seq_nodes<int>::L));
+		assert((btree_seq_nodes<int,16,16>::L==4)&&(btree_seq_nodes<int,16,16>::M==4));
+		S200 s;
+		s.c[0]='a';
+		as.assign(100,s);
+		as[50].c[0]='b';
+		as.erase(as.begin(),as.begin()+50);
+		assert(as.size()==50&&as[0].c[0]=='b'&&as[49].c[0]=='a');
+		btree_seq<int,btree_seq_nodes<int,256,4096>::L,btree_seq_nodes<int,256,4096>::M> ab;
+		assert(ab.__leaf_size()<=4096&&ab.__branch_size()<=256);
+	}
+}
+
 #ifdef enable_nomem_tests
 #include <ext/throw_allocator.h>
 void TestNoMemExceptions()
@@ -963,6 +2568,14 @@ void TestNoMemExceptions()
 		PerformCheck(mc,vi,600000,50,60,90,100,10);
 		PerformCheck(mc,vi,600000,50,95,95,95,10);
 		PerformCheck(mc,vi,600000,75,85,95,98,10);
+		MultipleChecker<IntContainer,__gnu_cxx::throw_allocator_random<IntContainer>,
+			btree_seq_prefix_policy> mcp;
+		PerformCheck(mcp,vi,600000,75,85,95,98,10);
+		PerformCheck(mcp,vi,600000,50,95,95,95,10);
+		MultipleChecker<IntContainer,__gnu_cxx::throw_allocator_random<IntContainer>,
+			btree_seq_aligned_policy> mca;
+		PerformCheck(mca,vi,600000,75,85,95,98,10);
+		PerformCheck(mca,vi,600000,50,95,95,95,10);
 	}
 }
 class ExceptionTest
@@ -1079,11 +2692,42 @@ void CorrectnessTestBundle()
 	//Functionality tests
 	BasicTest_Int();
 	BasicTest_IntContainer();	
+	BasicTest_Prefix();
+	BasicTest_Prefetch();
+	BasicTest_Aligned();
+	BasicTest_Narrow();
+	MaxSizeTest();
+	BasicTest_Finger();
+	HintTest();
+	GatherScatterTest();
 	IteratorsTest_Int();
+	IteratorsTest_Deep();
 	TestFill_Int();
+	BulkLoadTest();
+	AppenderTest();
+	CowTest();
+	CowEraseTest();
+	EraseIfTest();
+	InsertBatchTest();
+	MvccTest();
+	ParallelAssignTest();
+	ReserveShrinkTest();
+	CompactTest();
+	PoolAllocatorTest();
+	PmrTest();
+	ThreadCacheTest();
+	AllocatorMoveTest();
+	MinimalAllocatorTest();
 	AttachTest<NormalTest>();
 	DetachTest<NormalTest>();
+	AttachTest<PrefixTest>();
+	DetachTest<PrefixTest>();
+	AttachTest<PrefetchTest>();
+	DetachTest<PrefetchTest>();
+	AttachTest<AlignedTest>();
+	DetachTest<AlignedTest>();
 	LeftTests();
+	FreezeTest();
 	cout<<"\n";
 
 	//Syntactic sugar tests
@@ -1094,6 +2738,7 @@ void CorrectnessTestBundle()
 	InsertIteratorTest();
 	EraseIteratorTest();
 	RelationsTest();
+	NodeSizeTest();
 	cout<<"\n";
 
 	//Exception tests
@@ -1184,7 +2829,8 @@ inline void insert_val(std::deque<int> &vi,int pos,int val)
 	vi.insert(vi.begin()+pos,val);
 } 
 
-inline void insert_val(btree_seq<int> &akai,int pos,int val)
+template <int L,int M,typename A,typename P>
+inline void insert_val(btree_seq<int,L,M,A,P> &akai,int pos,int val)
 {
 	akai.insert(pos,val);
 } 
@@ -1199,7 +2845,8 @@ inline void erase_val(std::deque<int> &vi,int pos)
 	vi.erase(vi.begin()+pos);
 } 
 
-inline void erase_val(btree_seq<int> &akai,int pos)
+template <int L,int M,typename A,typename P>
+inline void erase_val(btree_seq<int,L,M,A,P> &akai,int pos)
 {
 	akai.erase(akai.begin()+pos);
 } 
@@ -1260,7 +2907,8 @@ int SumArray(IntContainer &ic)
 	return res;
 }
 
-int Visiting(btree_seq<int> &aka)
+template <int L,int M,typename A,typename P>
+int Visiting(btree_seq<int,L,M,A,P> &aka)
 {
 	SumVisitor sv;
 	aka.visit(0,aka.size(),sv);
@@ -1508,6 +3156,77 @@ void MultipleOperationsTest(ofstream &ofs,int arr,int maxsz)
 	cout<<"Test with "<<arr<<" elements completed.\n";
 }
 
+//Allocator taking the nodes from one pool of huge pages.
+template<class T> struct HugePageAllocator:public btree_seq_pool_allocator<T>
+{
+	template<class U> struct rebind{typedef HugePageAllocator<U> other;};
+	HugePageAllocator():btree_seq_pool_allocator<T>(pool()){}
+	template<class U> HugePageAllocator(const HugePageAllocator<U> &a):btree_seq_pool_allocator<T>(a){}
+	static btree_seq_node_pool &pool()
+	{
+		static btree_seq_node_pool huge(1,true);
+		return huge;
+	}
+};
+
+#if __cplusplus >= 201103L
+//Each thread builds containers of size elements by random inserts, erases half of them
+//and drops the containers.
+template <class Container>
+void ChurnThread(int containers,int size,int rounds,unsigned int place)
+{
+	for(int r=0;r<rounds;r++){
+		std::vector<Container> vecCon(containers);
+		typename std::vector<Container>::iterator it;
+		for(it=vecCon.begin();it!=vecCon.end();it++){
+			for(int j=0;j<size;j++){
+				next_rand(place);
+				it->insert(place%(j+1),j);
+			}
+			for(int j=size;j>size/2;j--){
+				next_rand(place);
+				it->erase(place%j,place%j+1);
+			}
+		}
+	}
+}
+
+template <class Container>
+void ThreadedChurnCheck(ofstream &ofs,const char *name,int size)
+{
+	int threads[]={1,4,16},rounds=2000/size;
+	for(int k=0;k<3;k++){
+		std::vector<std::thread> th;
+		double start=MSec();
+		for(int j=0;j<threads[k];j++){
+			th.push_back(std::thread(ChurnThread<Container>,1000,size,rounds,j+2));
+		}
+		for(int j=0;j<threads[k];j++){
+			th[j].join();
+		}
+		ofs<<setw(34)<<name<<setw(8)<<size<<setw(8)<<threads[k]<<" "<<setw(9)
+			<<((MSec()-start)/threads[k]/rounds/1000/(size+size/2))<<"\n";
+	}
+}
+
+void ThreadedAllocationTest(ofstream &ofs)
+{
+	ofs<<"Threads changing their own containers. Time is given per insert/erase.\n";
+	ofs<<"                         Allocator    Size Threads      Time\n";
+	ofs<<setprecision(2)<<scientific;
+	ThreadedChurnCheck<btree_seq<int> >(ofs,"std::allocator",16);
+	ThreadedChurnCheck<btree_seq<int,btree_seq_nodes<int>::L,btree_seq_nodes<int>::M,
+		btree_seq_thread_cache_allocator<int> > >(ofs,"btree_seq_thread_cache_allocator",16);
+	ThreadedChurnCheck<btree_seq<int> >(ofs,"std::allocator",1000);
+	ThreadedChurnCheck<btree_seq<int,btree_seq_nodes<int>::L,btree_seq_nodes<int>::M,
+		btree_seq_thread_cache_allocator<int> > >(ofs,"btree_seq_thread_cache_allocator",1000);
+	ofs<<"\n\n\n";
+	cout<<"Test with threads completed.\n";
+}
+#else
+void ThreadedAllocationTest(ofstream &){}
+#endif
+
 void PerformanceTest()
 {
 	TestDescriptor t1("Now performance tests.");
@@ -1530,11 +3249,31 @@ void PerformanceTest()
  		SingleOperationPerformanceCheck<btree_seq<int> >(ofs,1000,5000);
 		ofs<<"\n\nbtree_seq<int>\n";
  		SingleOperationPerformanceCheck<btree_seq<int> >(ofs,10,50000);
+		ofs<<"\n\nbtree_seq<int> with prefix sums in branches (btree_seq_prefix_policy)\n";
+		SingleOperationPerformanceCheck<btree_seq<int,btree_seq_nodes<int>::L,
+			btree_seq_nodes<int>::M,std::allocator<int>,btree_seq_prefix_policy> >(ofs,10,50000);
+		ofs<<"\n\nbtree_seq<int> with aligned nodes (btree_seq_aligned_policy)\n";
+		SingleOperationPerformanceCheck<btree_seq<int,btree_seq_nodes<int>::L,
+			btree_seq_nodes<int>::M,std::allocator<int>,btree_seq_aligned_policy> >(ofs,10,50000);
+		ofs<<"\n\nbtree_seq<int>, 100000 small containers\n";
+		SingleOperationPerformanceCheck<btree_seq<int> >(ofs,100000,512);
+		ofs<<"\n\nbtree_seq<int> with node pool (btree_seq_pool_allocator), 100000 small containers\n";
+		SingleOperationPerformanceCheck<btree_seq<int,btree_seq_nodes<int>::L,
+			btree_seq_nodes<int>::M,btree_seq_pool_allocator<int> > >(ofs,100000,512);
+		ofs<<"\n\nbtree_seq<int>, large sizes\n";
+		SingleOperationPerformanceCheck<btree_seq<int> >(ofs,1,20000000);
+		ofs<<"\n\nbtree_seq<int> with nodes on huge pages (btree_seq_node_pool), large sizes\n";
+		SingleOperationPerformanceCheck<btree_seq<int,btree_seq_nodes<int>::L,
+			btree_seq_nodes<int>::M,HugePageAllocator<int> > >(ofs,1,20000000);
+		ofs<<"\n\nbtree_seq<int> with software prefetch (btree_seq_prefetch_policy), large sizes\n";
+		SingleOperationPerformanceCheck<btree_seq<int,btree_seq_nodes<int>::L,
+			btree_seq_nodes<int>::M,std::allocator<int>,btree_seq_prefetch_policy> >(ofs,1,20000000);
  		TestRope(ofs);
  		TestVStadnik(ofs);
 		MultipleOperationsTest(ofs,5,10000000);
 		MultipleOperationsTest(ofs,50,10000000);
 		MultipleOperationsTest(ofs,500,10000000);
+		ThreadedAllocationTest(ofs);
 	}
 }
 